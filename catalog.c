@@ -0,0 +1,313 @@
+/* See LICENSE file for copyright and license details. */
+#include "pkg.h"
+
+/*
+ * The catalog of a mirror, built by mkindexpkg and served next to the
+ * plain list of package archives.  Like a snapshot it holds no
+ * pointers and is used straight from an mmap()ed file: packages refer
+ * to their files and dependencies by index, and names are offsets into
+ * a string table where each string is stored once.  Offset 0 is the
+ * empty string.
+ *
+ * The files of a package are stored next to each other in archive
+ * order.  The path index lists all files sorted by path, so the
+ * packages providing a path are found with a binary search.  Numbers
+ * are in host byte order, which is recorded so a mismatch is detected.
+ */
+
+#define CATMAGIC  "PKGCAT1"
+#define CATENDIAN 0x01020304U
+
+/* Check that all indices and offsets of the catalog are in range */
+static int
+cat_valid(const struct cathdr *h, size_t size)
+{
+	const struct catpkg *pkgs;
+	const struct catfile *files;
+	const uint32_t *index, *deps;
+	const char *strs;
+	uint32_t i;
+
+	if ((uint64_t)sizeof(*h) + (uint64_t)h->npkgs * sizeof(*pkgs) +
+	    (uint64_t)h->nfiles * (sizeof(*files) + sizeof(*index)) +
+	    (uint64_t)h->ndeps * sizeof(*deps) + h->strsz != size)
+		return 0;
+	pkgs = (const void *)(h + 1);
+	files = (const void *)(pkgs + h->npkgs);
+	index = (const void *)(files + h->nfiles);
+	deps = (const void *)(index + h->nfiles);
+	strs = (const void *)(deps + h->ndeps);
+	if (h->strsz == 0 || strs[0] != '\0' || strs[h->strsz - 1] != '\0')
+		return 0;
+	for (i = 0; i < h->npkgs; i++) {
+		if (pkgs[i].file >= h->strsz || pkgs[i].name >= h->strsz ||
+		    pkgs[i].version >= h->strsz ||
+		    pkgs[i].files > h->nfiles ||
+		    pkgs[i].nfiles > h->nfiles - pkgs[i].files ||
+		    pkgs[i].deps > h->ndeps ||
+		    pkgs[i].ndeps > h->ndeps - pkgs[i].deps)
+			return 0;
+	}
+	for (i = 0; i < h->nfiles; i++)
+		if (files[i].path >= h->strsz || files[i].pkg >= h->npkgs ||
+		    index[i] >= h->nfiles)
+			return 0;
+	for (i = 0; i < h->ndeps; i++)
+		if (deps[i] >= h->strsz)
+			return 0;
+	return 1;
+}
+
+/* Map the catalog open as `fd'.  Return -1 if it is not one */
+int
+cat_map(struct catalog *cat, int fd)
+{
+	struct stat sb;
+	void *p;
+
+	if (fstat(fd, &sb) < 0 || (size_t)sb.st_size < sizeof(*cat->h))
+		return -1;
+	p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		return -1;
+	cat->map = p;
+	cat->size = sb.st_size;
+	cat->h = p;
+	if (memcmp(cat->h->magic, CATMAGIC, sizeof(cat->h->magic)) != 0 ||
+	    cat->h->endian != CATENDIAN || !cat_valid(cat->h, cat->size)) {
+		munmap(p, cat->size);
+		return -1;
+	}
+	cat->pkgs = (const void *)(cat->h + 1);
+	cat->files = (const void *)(cat->pkgs + cat->h->npkgs);
+	cat->index = (const void *)(cat->files + cat->h->nfiles);
+	cat->deps = (const void *)(cat->index + cat->h->nfiles);
+	cat->strs = (const void *)(cat->deps + cat->h->ndeps);
+	return 0;
+}
+
+/* Map the catalog in `path' */
+int
+cat_open(struct catalog *cat, const char *path)
+{
+	int fd, r;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		weprintf("open %s:", path);
+		return -1;
+	}
+	if ((r = cat_map(cat, fd)) < 0)
+		weprintf("%s: not a catalog\n", path);
+	close(fd);
+	return r;
+}
+
+void
+cat_close(struct catalog *cat)
+{
+	munmap(cat->map, cat->size);
+}
+
+/* Find the files of all packages shipping `path', relative to the root
+ * and given with a trailing slash for a directory.  Return how many
+ * there are and point `idx' to their first entry in the path index */
+size_t
+cat_find(const struct catalog *cat, const char *path, const uint32_t **idx)
+{
+	size_t lo = 0, hi = cat->h->nfiles, mid, first;
+	int c;
+
+	while (strncmp(path, "./", 2) == 0)
+		path += 2;
+	while (*path == '/')
+		path++;
+	/* the first entry not sorting before `path' */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		c = strcmp(cat->strs + cat->files[cat->index[mid]].path, path);
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	first = lo;
+	while (lo < cat->h->nfiles &&
+	       strcmp(cat->strs + cat->files[cat->index[lo]].path, path) == 0)
+		lo++;
+	*idx = cat->index + first;
+	return lo - first;
+}
+
+static uint32_t
+str_hash(const char *s)
+{
+	uint32_t h = 0x811c9dc5U;
+
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 0x01000193U;
+	return h;
+}
+
+/* Add a string to the table unless it is there already, and return its
+ * offset.  The table of offsets is open addressed and at most half full */
+static uint32_t
+str_add(struct catbuild *b, const char *s)
+{
+	uint32_t *old, h, i;
+	size_t len = strlen(s) + 1, oldsz, j;
+
+	if (2 * (b->nstrs + 1) > b->stabsz) {
+		old = b->stab;
+		oldsz = b->stabsz;
+		b->stabsz = oldsz ? oldsz * 2 : 4096;
+		b->stab = ecalloc(b->stabsz, sizeof(*b->stab));
+		for (j = 0; j < oldsz; j++) {
+			if (!old[j])
+				continue;
+			for (i = str_hash(b->strs + old[j]) & (b->stabsz - 1);
+			     b->stab[i]; i = (i + 1) & (b->stabsz - 1))
+				;
+			b->stab[i] = old[j];
+		}
+		free(old);
+	}
+	if (s[0] == '\0')
+		return 0;
+	for (h = str_hash(s) & (b->stabsz - 1); b->stab[h];
+	     h = (h + 1) & (b->stabsz - 1))
+		if (strcmp(b->strs + b->stab[h], s) == 0)
+			return b->stab[h];
+
+	if (b->strsz + len > UINT32_MAX)
+		eprintf("catalog too large\n");
+	while (b->strsz + len > b->strcap) {
+		b->strcap = b->strcap ? b->strcap * 2 : 65536;
+		b->strs = erealloc(b->strs, b->strcap);
+	}
+	memcpy(b->strs + b->strsz, s, len);
+	b->stab[h] = b->strsz;
+	b->strsz += len;
+	b->nstrs++;
+	return b->stab[h];
+}
+
+void
+cat_init(struct catbuild *b)
+{
+	memset(b, 0, sizeof(*b));
+	/* offset 0 is the empty string, so it never needs a slot */
+	b->strcap = 65536;
+	b->strs = emalloc(b->strcap);
+	b->strs[0] = '\0';
+	b->strsz = 1;
+}
+
+/* Add `pkg', stored in the mirror as `file', and its `paths' */
+void
+cat_add(struct catbuild *b, const struct pkg *pkg, const char *file,
+	uint64_t size, const uint8_t *sha, char **paths, size_t npaths)
+{
+	struct catpkg *cp;
+	struct pkgdep *dep;
+	size_t i;
+
+	b->pkgs = erealloc(b->pkgs, (b->npkgs + 1) * sizeof(*b->pkgs));
+	cp = &b->pkgs[b->npkgs];
+	memset(cp, 0, sizeof(*cp));
+	cp->size = size;
+	memcpy(cp->sha256, sha, sizeof(cp->sha256));
+	cp->file = str_add(b, file);
+	cp->name = str_add(b, pkg->name);
+	cp->version = str_add(b, pkg->version ? pkg->version : "");
+
+	cp->deps = b->ndeps;
+	TAILQ_FOREACH(dep, &pkg->dep_head, entry) {
+		b->deps = erealloc(b->deps, (b->ndeps + 1) * sizeof(*b->deps));
+		b->deps[b->ndeps++] = str_add(b, dep->name);
+	}
+	cp->ndeps = b->ndeps - cp->deps;
+
+	cp->files = b->nfiles;
+	if (npaths > 0)
+		b->files = erealloc(b->files,
+				    (b->nfiles + npaths) * sizeof(*b->files));
+	for (i = 0; i < npaths; i++) {
+		b->files[b->nfiles].path = str_add(b, paths[i]);
+		b->files[b->nfiles].pkg = b->npkgs;
+		b->nfiles++;
+	}
+	cp->nfiles = npaths;
+	b->npkgs++;
+}
+
+/* qsort() has no way to pass the string table to cmpindex() */
+static const struct catbuild *sortbuild;
+
+static int
+cmpindex(const void *a, const void *b)
+{
+	const struct catfile *x = &sortbuild->files[*(const uint32_t *)a];
+	const struct catfile *y = &sortbuild->files[*(const uint32_t *)b];
+	int c;
+
+	if ((c = strcmp(sortbuild->strs + x->path, sortbuild->strs + y->path)))
+		return c;
+	return x->pkg < y->pkg ? -1 : x->pkg > y->pkg;
+}
+
+/* Write the catalog to `path' */
+int
+cat_save(struct catbuild *b, const char *path)
+{
+	struct cathdr h;
+	uint32_t *index;
+	size_t i;
+	FILE *fp;
+	int r = 0;
+
+	index = emalloc(MAX(b->nfiles, 1) * sizeof(*index));
+	for (i = 0; i < b->nfiles; i++)
+		index[i] = i;
+	sortbuild = b;
+	qsort(index, b->nfiles, sizeof(*index), cmpindex);
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CATMAGIC, sizeof(h.magic));
+	h.endian = CATENDIAN;
+	h.npkgs = b->npkgs;
+	h.nfiles = b->nfiles;
+	h.ndeps = b->ndeps;
+	h.strsz = b->strsz;
+
+	if (!(fp = fopen(path, "w"))) {
+		weprintf("fopen %s:", path);
+		free(index);
+		return -1;
+	}
+	fwrite(&h, sizeof(h), 1, fp);
+	if (b->npkgs > 0)
+		fwrite(b->pkgs, sizeof(*b->pkgs), b->npkgs, fp);
+	if (b->nfiles > 0) {
+		fwrite(b->files, sizeof(*b->files), b->nfiles, fp);
+		fwrite(index, sizeof(*index), b->nfiles, fp);
+	}
+	if (b->ndeps > 0)
+		fwrite(b->deps, sizeof(*b->deps), b->ndeps, fp);
+	fwrite(b->strs, 1, b->strsz, fp);
+	if (ferror(fp) | (fclose(fp) == EOF)) {
+		weprintf("write %s:", path);
+		r = -1;
+	}
+	free(index);
+	return r;
+}
+
+void
+cat_free(struct catbuild *b)
+{
+	free(b->pkgs);
+	free(b->files);
+	free(b->deps);
+	free(b->strs);
+	free(b->stab);
+}
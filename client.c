@@ -0,0 +1,56 @@
+/* See LICENSE file for copyright and license details. */
+#include "pkg.h"
+
+/* Fill in the address of the pkgd socket for the given root */
+int
+pkgd_addr(const char *root, struct sockaddr_un *sun)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (strlcpy(sun->sun_path, root, sizeof(sun->sun_path)) >= sizeof(sun->sun_path) ||
+	    strlcat(sun->sun_path, PKGDSOCK, sizeof(sun->sun_path)) >= sizeof(sun->sun_path))
+		return -1;
+	return 0;
+}
+
+/* Send a query to the pkgd serving `root'.  Return -1 if no daemon is
+ * running, so the caller can fall back to reading the db itself, 1 if
+ * the daemon failed to answer the query and 0 with the response in
+ * `fp' otherwise */
+int
+pkgd_query(const char *root, FILE **fp, const char *cmd, const char *arg)
+{
+	struct sockaddr_un sun;
+	char *buf = NULL;
+	size_t sz = 0;
+	ssize_t len;
+	int fd;
+
+	if (pkgd_addr(root, &sun) < 0)
+		return -1;
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+	    !(*fp = fdopen(fd, "r+"))) {
+		close(fd);
+		return -1;
+	}
+
+	fprintf(*fp, "%s%s%s\n", cmd, arg ? " " : "", arg ? arg : "");
+	if (fflush(*fp) == EOF ||
+	    (len = getline(&buf, &sz, *fp)) <= 0 || buf[len - 1] != '\n') {
+		/* the daemon went away, pretend it was never there */
+		free(buf);
+		fclose(*fp);
+		return -1;
+	}
+	buf[len - 1] = '\0';
+	if (strcmp(buf, "ok") != 0) {
+		weprintf("pkgd: %s\n", strncmp(buf, "error ", 6) == 0 ? buf + 6 : buf);
+		free(buf);
+		fclose(*fp);
+		return 1;
+	}
+	free(buf);
+	return 0;
+}
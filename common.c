@@ -1,6 +1,31 @@
 /* See LICENSE file for copyright and license details. */
 #include "pkg.h"
 
+/* Strip the extension off a package filename in place, everything from
+ * the last ".pkg." on, e.g. .pkg.tgz, .pkg.tzst or .pkg.dtgz.  Names
+ * without it lose their last two extensions.  Return -1 if there are
+ * not enough of them */
+static int
+strip_ext(char *filename)
+{
+	char *p, *q;
+	int i;
+
+	for (p = NULL, q = filename; (q = strstr(q, ".pkg.")); q++)
+		p = q;
+	if (p) {
+		*p = '\0';
+		return 0;
+	}
+	for (i = 0; i < 2; i++) {
+		p = strrchr(filename, '.');
+		if (!p)
+			return -1;
+		*p = '\0';
+	}
+	return 0;
+}
+
 /* Extract the package name from a filename.  e.g. /tmp/pkg#version.pkg.tgz */
 void
 parse_name(const char *path, char **name)
@@ -9,15 +34,8 @@ parse_name(const char *path, char **name)
 
 	estrlcpy(tmp, path, sizeof(tmp));
 	estrlcpy(filename, basename(tmp), sizeof(filename));
-	/* strip extension */
-	p = strrchr(filename, '.');
-	if (!p)
-		goto err;
-	*p = '\0';
-	p = strrchr(filename, '.');
-	if (!p)
+	if (strip_ext(filename) < 0)
 		goto err;
-	*p = '\0';
 	/* extract name */
 	p = strchr(filename, '#');
 	if (p)
@@ -39,15 +57,8 @@ parse_version(const char *path, char **version)
 
 	estrlcpy(tmp, path, sizeof(tmp));
 	estrlcpy(filename, basename(tmp), sizeof(filename));
-	/* strip extension */
-	p = strrchr(filename, '.');
-	if (!p)
+	if (strip_ext(filename) < 0)
 		goto err;
-	*p = '\0';
-	p = strrchr(filename, '.');
-	if (!p)
-		goto err;
-	*p = '\0';
 	/* extract version */
 	p = strchr(filename, '#');
 	if (!p) {
@@ -64,29 +75,38 @@ err:
 		path);
 }
 
-void
-parse_db_name(const char *path, char **name)
+/* Split a db entry name, e.g. pkg#version, without copying it.  Return
+ * the length of the package name and point `version' at the version,
+ * or at NULL if there is none.  `version' may be NULL */
+size_t
+parse_db_entry(const char *file, const char **version)
 {
-	char tmp[PATH_MAX], *p;
+	const char *p;
 
-	estrlcpy(tmp, path, sizeof(tmp));
-	p = strchr(tmp, '#');
-	if (p)
-		*p = '\0';
-	*name = estrdup(tmp);
+	p = strchr(file, '#');
+	if (version)
+		*version = p ? p + 1 : NULL;
+	return p ? (size_t)(p - file) : strlen(file);
 }
 
-void
-parse_db_version(const char *path, char **version)
+long
+estrtol(const char *s, int base)
 {
-	char tmp[PATH_MAX], *p;
+	char *end;
+	long l;
 
-	estrlcpy(tmp, path, sizeof(tmp));
-	p = strchr(tmp, '#');
-	if (p)
-		*p = '\0';
-	if (p)
-		*version = estrdup(p + 1);
-	else
-		*version = NULL;
+	errno = 0;
+	l = strtol(s, &end, base);
+	if (errno != 0 || end == s || *end != '\0')
+		eprintf("%s: not a valid number\n", s);
+	return l;
+}
+
+/* Compare two package versions, either of which may be missing */
+int
+version_eq(const char *a, const char *b)
+{
+	if (!a || !b)
+		return a == b;
+	return strcmp(a, b) == 0;
 }
@@ -1,4 +1,13 @@
 VERSION = "0.4.2"
 CPPFLAGS = -D_BSD_SOURCE -D_GNU_SOURCE -DVERSION=\"${VERSION}\"
 CFLAGS = ${CPPFLAGS} 
-LDFLAGS = 
+LDFLAGS = -lpthread
+CURLLIBS = -lcurl
+
+# decode gzip packages with libdeflate
+#CPPFLAGS += -DHAVE_LIBDEFLATE
+#LDFLAGS += -ldeflate
+
+# decode zstd packages with libzstd, in parallel for multi-frame ones
+#CPPFLAGS += -DHAVE_ZSTD
+#LDFLAGS += -lzstd
@@ -1,16 +1,20 @@
 /* See LICENSE file for copyright and license details. */
 #include "pkg.h"
 
+int aflag = ATOMIC_NONE;
+int cflag = 0;
 int fflag = 0;
 int vflag = 0;
+long nwriters = 1;
 
 struct db *
 db_new(const char *root)
 {
 	struct db *db;
 	struct sigaction sa;
+	char path[PATH_MAX];
 
-	db = emalloc(sizeof(*db));
+	db = ecalloc(1, sizeof(*db));
 	TAILQ_INIT(&db->pkg_head);
 	TAILQ_INIT(&db->pkg_rm_head);
 
@@ -30,6 +34,10 @@ db_new(const char *root)
 		return NULL;
 	}
 
+	estrlcpy(path, db->path, sizeof(path));
+	estrlcat(path, "/" DBSHARDED, sizeof(path));
+	db->sharded = access(path, F_OK) == 0;
+
 	TAILQ_INIT(&db->rejrule_head);
 	rej_load(db);
 
@@ -43,8 +51,10 @@ db_new(const char *root)
 	return db;
 }
 
-int
-db_free(struct db *db)
+/* Drop all packages and paths, leaving an empty db that can be loaded
+ * again */
+void
+db_unload(struct db *db)
 {
 	struct pkg *pkg, *tmp;
 
@@ -60,58 +70,228 @@ db_free(struct db *db)
 		pkg_free(pkg);
 	}
 
+	path_free(db);
+	arena_free(&db->arena);
+}
+
+int
+db_free(struct db *db)
+{
+	db_unload(db);
 	closedir(db->pkgdir);
+	if (db->sharddir)
+		closedir(db->sharddir);
 	rej_free(db);
+	free(db->buf);
 	free(db);
 	return 0;
 }
 
+/* Return the generation of the db, which db_add() and db_rm() bump */
+uint64_t
+db_generation(struct db *db)
+{
+	char path[PATH_MAX], buf[32];
+	ssize_t n;
+	int fd;
+
+	estrlcpy(path, db->path, sizeof(path));
+	estrlcat(path, "/" DBGENERATION, sizeof(path));
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 0;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return 0;
+	buf[n] = '\0';
+	return strtoull(buf, NULL, 10);
+}
+
+/* Bump the generation of the db.  The counter is updated in place under
+ * a lock, so concurrent installs never lose a bump and DBPATH itself is
+ * not modified */
+static void
+db_bump(struct db *db)
+{
+	char path[PATH_MAX], buf[32];
+	unsigned long long gen = 0;
+	ssize_t n;
+	int fd;
+
+	estrlcpy(path, db->path, sizeof(path));
+	estrlcat(path, "/" DBGENERATION, sizeof(path));
+	if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+		weprintf("open %s:", path);
+		return;
+	}
+	if (flock(fd, LOCK_EX) < 0)
+		weprintf("flock %s:", path);
+	if ((n = read(fd, buf, sizeof(buf) - 1)) > 0) {
+		buf[n] = '\0';
+		gen = strtoull(buf, NULL, 10);
+	}
+	n = snprintf(buf, sizeof(buf), "%llu\n", gen + 1);
+	if (pwrite(fd, buf, n, 0) != n || ftruncate(fd, n) < 0)
+		weprintf("write %s:", path);
+	close(fd);
+}
+
+static void
+depends_path(struct db *db, const char *file, char *path, size_t sz)
+{
+	estrlcpy(path, db->path, sz);
+	estrlcat(path, "/" DBDEPENDS "/", sz);
+	estrlcat(path, file, sz);
+}
+
+/* Record the dependencies of a package next to its db entry, as
+ * DBDEPENDS/name#version, one package name per line */
+static int
+db_add_depends(struct db *db, struct pkg *pkg, const char *file)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	struct pkgdep *dep;
+	FILE *fp;
+
+	depends_path(db, file, path, sizeof(path));
+	if (TAILQ_EMPTY(&pkg->dep_head)) {
+		unlink(path);
+		return 0;
+	}
+
+	estrlcpy(tmp, db->path, sizeof(tmp));
+	estrlcat(tmp, "/" DBDEPENDS, sizeof(tmp));
+	if (mkdir(tmp, 0755) < 0 && errno != EEXIST) {
+		weprintf("mkdir %s:", tmp);
+		return -1;
+	}
+	estrlcpy(tmp, path, sizeof(tmp));
+	estrlcat(tmp, ".tmp", sizeof(tmp));
+
+	if (!(fp = fopen(tmp, "w"))) {
+		weprintf("fopen %s:", tmp);
+		return -1;
+	}
+	TAILQ_FOREACH(dep, &pkg->dep_head, entry) {
+		fputs(dep->name, fp);
+		fputc('\n', fp);
+	}
+	if (fflush(fp) == EOF || ferror(fp)) {
+		weprintf("write %s:", tmp);
+		fclose(fp);
+		unlink(tmp);
+		return -1;
+	}
+	fclose(fp);
+	if (rename(tmp, path) < 0) {
+		weprintf("rename %s:", tmp);
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/* Write the db entry of a package.  The entry is written to a
+ * temporary file first and renamed into place, so an existing entry
+ * of the same package is replaced atomically */
 int
 db_add(struct db *db, struct pkg *pkg)
 {
-	char path[PATH_MAX];
-	char *name, *version;
+	char file[PATH_MAX], path[PATH_MAX], tmp[PATH_MAX], buf[PATH_MAX];
 	struct pkgentry *pe;
 	FILE *fp;
 
-	parse_name(pkg->path, &name);
-	parse_version(pkg->path, &version);
-	estrlcpy(path, db->path, sizeof(path));
-	estrlcat(path, "/", sizeof(path));
-	estrlcat(path, name, sizeof(path));
-	if (version) {
-		estrlcat(path, "#", sizeof(path));
-		estrlcat(path, version, sizeof(path));
+	estrlcpy(file, pkg->name, sizeof(file));
+	if (pkg->version) {
+		estrlcat(file, "#", sizeof(file));
+		estrlcat(file, pkg->version, sizeof(file));
 	}
-	free(name);
-	free(version);
+	if (db->sharded) {
+		db_shardpath(db, db_shard(file), tmp);
+		if (mkdir(tmp, 0755) < 0 && errno != EEXIST) {
+			weprintf("mkdir %s:", tmp);
+			return -1;
+		}
+	}
+	db_entrypath(db, file, path);
+	/* the temporary file goes next to the entry so it can be renamed */
+	estrlcpy(tmp, path, sizeof(tmp));
+	strrchr(tmp, '/')[1] = '\0';
+	estrlcat(tmp, ".", sizeof(tmp));
+	estrlcat(tmp, file, sizeof(tmp));
+	estrlcat(tmp, ".tmp", sizeof(tmp));
+
+	if (db_add_depends(db, pkg, file) < 0)
+		return -1;
 
-	if (!(fp = fopen(path, "w"))) {
-		weprintf("fopen %s:", path);
+	if (!(fp = fopen(tmp, "w"))) {
+		weprintf("fopen %s:", tmp);
 		return -1;
 	}
 
 	TAILQ_FOREACH(pe, &pkg->pe_head, entry) {
 		if (vflag == 1)
-			printf("installed %s\n", pe->path);
-		fputs(pe->rpath, fp);
+			printf("installed %s\n", pkgentry_path(pe, buf));
+		fputs(pkgentry_rpath(pe, buf), fp);
 		fputc('\n', fp);
 	}
 
 	if (vflag == 1)
 		printf("adding %s\n", path);
-	fflush(fp);
+	if (fflush(fp) == EOF || ferror(fp)) {
+		weprintf("write %s:", tmp);
+		fclose(fp);
+		unlink(tmp);
+		return -1;
+	}
 	if (fsync(fileno(fp)) < 0)
-		weprintf("fsync %s:", path);
+		weprintf("fsync %s:", tmp);
 	fclose(fp);
 
+	if (rename(tmp, path) < 0) {
+		weprintf("rename %s:", tmp);
+		unlink(tmp);
+		return -1;
+	}
+	db_bump(db);
+
 	return 0;
 }
 
+/* Take back the db entry db_add() wrote for `pkg', whose path is that
+ * of the package archive rather than of the entry */
+int
+db_unadd(struct db *db, struct pkg *pkg)
+{
+	char file[PATH_MAX], path[PATH_MAX];
+
+	estrlcpy(file, pkg->name, sizeof(file));
+	if (pkg->version) {
+		estrlcat(file, "#", sizeof(file));
+		estrlcat(file, pkg->version, sizeof(file));
+	}
+	db_entrypath(db, file, path);
+	if (vflag == 1)
+		printf("removing %s\n", path);
+	if (unlink(path) < 0) {
+		weprintf("unlink %s:", path);
+		return -1;
+	}
+	depends_path(db, file, path, sizeof(path));
+	if (unlink(path) < 0 && errno != ENOENT)
+		weprintf("unlink %s:", path);
+	db_bump(db);
+	sync();
+	return 0;
+}
+
+/* Remove the db entry of a package.  Callers sync() once they are done
+ * removing packages */
 int
 db_rm(struct db *db, struct pkg *pkg)
 {
-	(void) db;
+	char path[PATH_MAX];
+	const char *file;
 
 	if (vflag == 1)
 		printf("removing %s\n", pkg->path);
@@ -119,29 +299,216 @@ db_rm(struct db *db, struct pkg *pkg)
 		weprintf("remove %s:", pkg->path);
 		return -1;
 	}
-	sync();
+	file = strrchr(pkg->path, '/');
+	depends_path(db, file ? file + 1 : pkg->path, path, sizeof(path));
+	if (unlink(path) < 0 && errno != ENOENT)
+		weprintf("unlink %s:", path);
+	db_bump(db);
 	return 0;
 }
 
+/* Return the shard of a db entry, which only depends on the name of
+ * the package so it can be found without knowing its version */
+unsigned
+db_shard(const char *file)
+{
+	size_t len = parse_db_entry(file, NULL);
+	uint32_t h = 0x811c9dc5;
+
+	while (len--)
+		h = (h ^ (unsigned char)*file++) * 0x01000193;
+	return h % DBSHARDS;
+}
+
+/* Write the directory of shard `n' to `buf', of size PATH_MAX */
+char *
+db_shardpath(struct db *db, unsigned n, char *buf)
+{
+	char shard[4];
+
+	snprintf(shard, sizeof(shard), "/%02x", n % DBSHARDS);
+	estrlcpy(buf, db->path, PATH_MAX);
+	estrlcat(buf, shard, PATH_MAX);
+	return buf;
+}
+
+/* Write the path of the db entry `file' to `buf', of size PATH_MAX */
+char *
+db_entrypath(struct db *db, const char *file, char *buf)
+{
+	if (db->sharded)
+		db_shardpath(db, db_shard(file), buf);
+	else
+		estrlcpy(buf, db->path, PATH_MAX);
+	estrlcat(buf, "/", PATH_MAX);
+	estrlcat(buf, file, PATH_MAX);
+	return buf;
+}
+
+void
+db_rewind(struct db *db)
+{
+	rewinddir(db->pkgdir);
+	if (db->sharddir)
+		closedir(db->sharddir);
+	db->sharddir = NULL;
+	db->shard = 0;
+}
+
+/* Return the next db entry, in either layout.  Hidden files such as
+ * partially written entries and directories are skipped */
+struct dirent *
+db_next(struct db *db)
+{
+	struct dirent *dp;
+	char path[PATH_MAX];
+
+	for (;;) {
+		if (!db->sharded) {
+			dp = readdir(db->pkgdir);
+		} else {
+			while (!db->sharddir && db->shard < DBSHARDS) {
+				db_shardpath(db, db->shard++, path);
+				if (!(db->sharddir = opendir(path)) &&
+				    errno != ENOENT)
+					weprintf("opendir %s:", path);
+			}
+			if (!db->sharddir)
+				return NULL;
+			if (!(dp = readdir(db->sharddir))) {
+				closedir(db->sharddir);
+				db->sharddir = NULL;
+				continue;
+			}
+		}
+		if (!dp)
+			return NULL;
+		if (dp->d_name[0] != '.' && dp->d_type != DT_DIR)
+			return dp;
+	}
+}
+
+/* Find the db entry of the package `name' and copy it to `file'.  With
+ * a sharded db only the shard of the package is read */
+int
+db_lookup(struct db *db, const char *name, char *file, size_t sz)
+{
+	struct dirent *dp;
+	char path[PATH_MAX];
+	DIR *dir = db->pkgdir;
+	size_t len;
+	int r = -1;
+
+	if (db->sharded) {
+		if (!(dir = opendir(db_shardpath(db, db_shard(name), path))))
+			return -1;
+	} else {
+		rewinddir(dir);
+	}
+	while ((dp = readdir(dir))) {
+		if (dp->d_name[0] == '.')
+			continue;
+		len = parse_db_entry(dp->d_name, NULL);
+		if (strncmp(dp->d_name, name, len) == 0 && name[len] == '\0') {
+			estrlcpy(file, dp->d_name, sz);
+			r = 0;
+			break;
+		}
+	}
+	if (db->sharded)
+		closedir(dir);
+	return r;
+}
+
+/* Load all packages, from the snapshot of the db if it is up to date.
+ * Otherwise every entry is read and a new snapshot is taken */
 int
 db_load(struct db *db)
 {
 	struct pkg *pkg;
 	struct dirent *dp;
+	struct stat sb;
+	char cache[PATH_MAX];
+	uint64_t gen;
+	int64_t mtime;
 
-	while ((dp = readdir(db->pkgdir))) {
-		if (strcmp(dp->d_name, ".") == 0 ||
-		    strcmp(dp->d_name, "..") == 0)
-			continue;
+	/* the snapshot directory is created first, as creating it touches
+	 * the mtime of DBPATH which the snapshot records */
+	estrlcpy(cache, db->path, sizeof(cache));
+	estrlcat(cache, "/" DBCACHE, sizeof(cache));
+	mkdir(cache, 0755);
+
+	/* taken before reading anything, so changes made while loading
+	 * leave a snapshot that is already stale */
+	gen = db_generation(db);
+	if (stat(db->path, &sb) < 0) {
+		weprintf("stat %s:", db->path);
+		return -1;
+	}
+	mtime = (int64_t)sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+	if (snap_load(db, gen, mtime) == 0)
+		return 0;
+
+	db_rewind(db);
+	while ((dp = db_next(db))) {
 		pkg = pkg_load(db, dp->d_name);
 		if (!pkg)
 			return -1;
 		TAILQ_INSERT_TAIL(&db->pkg_head, pkg, entry);
+		db_own(db, pkg);
 	}
 
+	snap_save(db, gen, mtime);
 	return 0;
 }
 
+/* Look up an installed package by name */
+struct pkg *
+db_find(struct db *db, const char *name)
+{
+	struct pkg *pkg;
+
+	TAILQ_FOREACH(pkg, &db->pkg_head, entry)
+		if (strcmp(pkg->name, name) == 0)
+			return pkg;
+	return NULL;
+}
+
+static int
+cmpfile(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/* Write the sha256 of the sorted db entries, i.e. name#version, of the
+ * installed packages to `hex', so hosts with the same packages installed
+ * are in the same state */
+void
+db_state(struct db *db, char *hex)
+{
+	struct sha256 s;
+	struct pkg *pkg;
+	uint8_t md[SHA256_DIGEST_LENGTH];
+	const char **files = NULL, *file;
+	size_t n = 0, i;
+
+	TAILQ_FOREACH(pkg, &db->pkg_head, entry) {
+		files = erealloc(files, (n + 1) * sizeof(*files));
+		file = strrchr(pkg->path, '/');
+		files[n++] = file ? file + 1 : pkg->path;
+	}
+	if (n > 0)
+		qsort(files, n, sizeof(*files), cmpfile);
+	sha256_init(&s);
+	for (i = 0; i < n; i++) {
+		sha256_update(&s, files[i], strlen(files[i]));
+		sha256_update(&s, "\n", 1);
+	}
+	sha256_sum(&s, md);
+	sha256_tohex(md, hex);
+	free(files);
+}
+
 /* Walk through all packages in the db and call `cb' for each one */
 int
 db_walk(struct db *db, int (*cb)(struct db *, struct pkg *, void *), void *data)
@@ -160,17 +527,32 @@ db_walk(struct db *db, int (*cb)(struct db *, struct pkg *, void *), void *data)
 	return 0;
 }
 
-/* Return the number of packages that have references to the given path */
+/* Return the number of packages that have references to the path of
+ * the given entry */
 int
-db_links(struct db *db, const char *path)
+db_links(struct db *db, struct pkgentry *pe)
+{
+	(void) db;
+
+	return path_owners(pe->node);
+}
+
+/* Record `pkg' as an owner of its paths, for packages in pkg_head */
+void
+db_own(struct db *db, struct pkg *pkg)
 {
-	struct pkg *pkg;
 	struct pkgentry *pe;
-	int links = 0;
 
-	TAILQ_FOREACH(pkg, &db->pkg_head, entry)
-		TAILQ_FOREACH(pe, &pkg->pe_head, entry)
-			if (strcmp(pe->path, path) == 0)
-				links++;
-	return links;
+	TAILQ_FOREACH(pe, &pkg->pe_head, entry)
+		path_own(db, pe->node, pkg);
+}
+
+/* Forget about `pkg' owning its paths, when it leaves pkg_head */
+void
+db_disown(struct pkg *pkg)
+{
+	struct pkgentry *pe;
+
+	TAILQ_FOREACH(pe, &pkg->pe_head, entry)
+		path_disown(pe->node, pkg);
 }
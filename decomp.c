@@ -0,0 +1,417 @@
+/* See LICENSE file for copyright and license details. */
+#include "pkg.h"
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * libarchive decompresses packages block by block through its filters.
+ * A backend listed here instead decodes a whole compressed package into
+ * memory in one call, which a fast implementation does a lot quicker.
+ * Packages no backend takes, that a backend fails to decode, or that
+ * are too large to be held in memory, are read by libarchive as before.
+ */
+
+#define DECOMPMAX  (256 * 1024 * 1024)	/* largest package decoded in memory */
+#define DROPWINDOW (8 * 1024 * 1024)
+
+struct decomp {
+	const char *name;
+	const char *magic;
+	size_t magiclen;
+	/* return the decoded data in a buffer from malloc(), or NULL */
+	void *(*decode)(const unsigned char *, size_t, size_t *);
+};
+
+struct membuf {
+	void *buf;
+	size_t len;
+	int done;
+};
+
+struct filebuf {
+	int fd;
+	off_t off;			/* bytes read */
+	off_t dropped;			/* bytes dropped from the page cache */
+	char buf[65536];
+};
+
+#ifdef HAVE_LIBDEFLATE
+static void *
+gzip_decode(const unsigned char *in, size_t insz, size_t *outsz)
+{
+	struct libdeflate_decompressor *d;
+	enum libdeflate_result r;
+	unsigned char *out;
+	size_t cap, len = 0, inused, outused;
+
+	/* the trailer of the last member holds its size modulo 2^32,
+	 * which is all of it for the common single member package */
+	if (insz < 18)
+		return NULL;
+	cap = (size_t)in[insz - 4] | (size_t)in[insz - 3] << 8 |
+	      (size_t)in[insz - 2] << 16 | (size_t)in[insz - 1] << 24;
+	if (cap > DECOMPMAX)
+		return NULL;
+	cap = MAX(cap, 4096);
+	if (!(d = libdeflate_alloc_decompressor()))
+		return NULL;
+	out = emalloc(cap);
+	while (insz >= 2 && in[0] == 0x1f && in[1] == 0x8b) {
+		r = libdeflate_gzip_decompress_ex(d, in, insz, out + len,
+						  cap - len, &inused, &outused);
+		if (r == LIBDEFLATE_INSUFFICIENT_SPACE && cap < DECOMPMAX) {
+			cap = MIN(cap * 2, DECOMPMAX);
+			out = erealloc(out, cap);
+			continue;
+		}
+		if (r != LIBDEFLATE_SUCCESS) {
+			free(out);
+			out = NULL;
+			break;
+		}
+		in += inused;
+		insz -= inused;
+		len += outused;
+	}
+	libdeflate_free_decompressor(d);
+	*outsz = len;
+	return out;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+/* Dictionaries for packages compressed with one are looked up by their
+ * id in ZSTDDICTS, e.g. /etc/pkgtools/zstd/1234567 */
+#define ZSTDDICTS "/etc/pkgtools/zstd"
+
+struct zframes {
+	const unsigned char **in;	/* start of each frame */
+	size_t *insz;
+	size_t *off;			/* offset of its data in `out' */
+	size_t n;
+	size_t next;			/* next frame to decode */
+	unsigned char *out;
+	size_t outsz;
+	ZSTD_DDict *dict;
+	int err;
+	pthread_mutex_t lock;
+};
+
+static ZSTD_DDict *
+zstd_dict(const unsigned char *in, size_t insz)
+{
+	ZSTD_DDict *dict;
+	struct stat sb;
+	char path[PATH_MAX];
+	unsigned id;
+	void *p;
+	int fd;
+
+	if ((id = ZSTD_getDictID_fromFrame(in, insz)) == 0)
+		return NULL;
+	snprintf(path, sizeof(path), ZSTDDICTS "/%u", id);
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		weprintf("open %s:", path);
+		return NULL;
+	}
+	if (fstat(fd, &sb) < 0 || sb.st_size == 0 ||
+	    (p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		weprintf("mmap %s:", path);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	dict = ZSTD_createDDict(p, sb.st_size);
+	munmap(p, sb.st_size);
+	return dict;
+}
+
+static ZSTD_DCtx *
+zstd_dctx(ZSTD_DDict *dict)
+{
+	ZSTD_DCtx *dctx;
+	ZSTD_bounds b;
+
+	if (!(dctx = ZSTD_createDCtx()))
+		return NULL;
+	/* allow the large windows of packages made with --long */
+	b = ZSTD_dParam_getBounds(ZSTD_d_windowLogMax);
+	ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax, b.upperBound);
+	if (dict)
+		ZSTD_DCtx_refDDict(dctx, dict);
+	return dctx;
+}
+
+/* Decode frames until there are none left.  Frames are independent and
+ * their sizes known, so each goes straight to its place in the output */
+static void *
+zstd_worker(void *arg)
+{
+	struct zframes *z = arg;
+	ZSTD_DCtx *dctx;
+	size_t i, r;
+
+	if (!(dctx = zstd_dctx(z->dict))) {
+		pthread_mutex_lock(&z->lock);
+		z->err = 1;
+		pthread_mutex_unlock(&z->lock);
+		return NULL;
+	}
+	while (1) {
+		pthread_mutex_lock(&z->lock);
+		i = z->err ? z->n : z->next++;
+		pthread_mutex_unlock(&z->lock);
+		if (i >= z->n)
+			break;
+		r = ZSTD_decompressDCtx(dctx, z->out + z->off[i],
+					(i + 1 < z->n ? z->off[i + 1] : z->outsz) - z->off[i],
+					z->in[i], z->insz[i]);
+		if (ZSTD_isError(r)) {
+			pthread_mutex_lock(&z->lock);
+			z->err = 1;
+			pthread_mutex_unlock(&z->lock);
+		}
+	}
+	ZSTD_freeDCtx(dctx);
+	return NULL;
+}
+
+/* Frames of unknown size are streamed into a growing buffer instead */
+static void *
+zstd_stream(const unsigned char *in, size_t insz, ZSTD_DDict *dict,
+	    size_t *outsz)
+{
+	ZSTD_DCtx *dctx;
+	ZSTD_inBuffer ib = { in, insz, 0 };
+	ZSTD_outBuffer ob = { NULL, 0, 0 };
+	size_t r, inpos, outpos;
+
+	if (!(dctx = zstd_dctx(dict)))
+		return NULL;
+	do {
+		if (ob.pos == ob.size) {
+			if (ob.size >= DECOMPMAX) {
+				r = (size_t)-1;
+				break;
+			}
+			ob.size = MIN(MAX(ob.size * 2, insz * 4), DECOMPMAX);
+			ob.dst = erealloc(ob.dst, ob.size);
+		}
+		inpos = ib.pos;
+		outpos = ob.pos;
+		r = ZSTD_decompressStream(dctx, &ob, &ib);
+		if (ZSTD_isError(r))
+			break;
+		/* r is non-zero until the frame is complete and flushed */
+	} while ((ib.pos < ib.size || r != 0) &&
+		 (ib.pos != inpos || ob.pos != outpos));
+	ZSTD_freeDCtx(dctx);
+	if (r != 0) {
+		free(ob.dst);
+		return NULL;
+	}
+	*outsz = ob.pos;
+	return ob.dst ? ob.dst : emalloc(1);
+}
+
+/* libarchive streams zstd packages itself, long windows included, and
+ * does so faster than decoding them into memory in one thread.  Only
+ * take packages that need a dictionary, and packages made of several
+ * frames, e.g. by pzstd, which are decoded in parallel, one thread per
+ * online CPU */
+static void *
+zstd_decode(const unsigned char *in, size_t insz, size_t *outsz)
+{
+	struct zframes z = { 0 };
+	pthread_t *threads;
+	unsigned long long csz;
+	const unsigned char *p;
+	size_t left, fsz, total = 0, cap = 0, i;
+	long ncpu;
+	void *out = NULL;
+
+	z.dict = zstd_dict(in, insz);
+	for (p = in, left = insz; left > 0; p += fsz, left -= fsz) {
+		fsz = ZSTD_findFrameCompressedSize(p, left);
+		csz = ZSTD_getFrameContentSize(p, left);
+		if (ZSTD_isError(fsz) || csz == ZSTD_CONTENTSIZE_ERROR)
+			goto done;
+		if (csz == ZSTD_CONTENTSIZE_UNKNOWN || total + csz > DECOMPMAX) {
+			if (z.dict)
+				out = zstd_stream(in, insz, z.dict, outsz);
+			goto done;
+		}
+		if (z.n == cap) {
+			cap = cap ? cap * 2 : 64;
+			z.in = erealloc(z.in, cap * sizeof(*z.in));
+			z.insz = erealloc(z.insz, cap * sizeof(*z.insz));
+			z.off = erealloc(z.off, cap * sizeof(*z.off));
+		}
+		z.in[z.n] = p;
+		z.insz[z.n] = fsz;
+		z.off[z.n] = total;
+		z.n++;
+		total += csz;
+	}
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	ncpu = MAX(MIN(ncpu, (long)z.n), 1);
+	if (ncpu == 1 && !z.dict)
+		goto done;
+	z.out = emalloc(MAX(total, 1));
+	z.outsz = total;
+	pthread_mutex_init(&z.lock, NULL);
+	threads = emalloc(ncpu * sizeof(*threads));
+	for (i = 1; i < (size_t)ncpu; i++)
+		if (pthread_create(&threads[i], NULL, zstd_worker, &z) != 0)
+			break;
+	zstd_worker(&z);
+	while (--i > 0)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&z.lock);
+	if (z.err) {
+		free(z.out);
+	} else {
+		out = z.out;
+		*outsz = total;
+	}
+done:
+	free(z.in);
+	free(z.insz);
+	free(z.off);
+	ZSTD_freeDDict(z.dict);
+	return out;
+}
+#endif
+
+static const struct decomp decomps[] = {
+#ifdef HAVE_LIBDEFLATE
+	{ "libdeflate", "\x1f\x8b", 2, gzip_decode },
+#endif
+#ifdef HAVE_ZSTD
+	{ "zstd", "\x28\xb5\x2f\xfd", 4, zstd_decode },
+	/* pzstd starts with a skippable frame */
+	{ "zstd", "\x50\x2a\x4d\x18", 4, zstd_decode },
+#endif
+	{ NULL, NULL, 0, NULL }
+};
+
+static la_ssize_t
+mem_read(struct archive *ar, void *data, const void **buf)
+{
+	struct membuf *m = data;
+
+	(void) ar;
+
+	if (m->done)
+		return 0;
+	m->done = 1;
+	*buf = m->buf;
+	return m->len;
+}
+
+static int
+mem_close(struct archive *ar, void *data)
+{
+	struct membuf *m = data;
+
+	(void) ar;
+
+	free(m->buf);
+	free(m);
+	return ARCHIVE_OK;
+}
+
+/* With -c, the part of a package that was read is dropped from the
+ * page cache every DROPWINDOW bytes */
+static la_ssize_t
+file_read(struct archive *ar, void *data, const void **buf)
+{
+	struct filebuf *f = data;
+	ssize_t n;
+
+	if ((n = read(f->fd, f->buf, sizeof(f->buf))) < 0) {
+		archive_set_error(ar, errno, "read");
+		return -1;
+	}
+	f->off += n;
+	if (f->off - f->dropped >= DROPWINDOW) {
+		posix_fadvise(f->fd, f->dropped, f->off - f->dropped,
+			      POSIX_FADV_DONTNEED);
+		f->dropped = f->off;
+	}
+	*buf = f->buf;
+	return n;
+}
+
+static int
+file_close(struct archive *ar, void *data)
+{
+	struct filebuf *f = data;
+
+	(void) ar;
+
+	posix_fadvise(f->fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(f->fd);
+	free(f);
+	return ARCHIVE_OK;
+}
+
+/* Open the package archive at `path' for reading with `ar', from
+ * pkg_archive_new(), decoding it with the first backend that takes it */
+int
+pkg_archive_open(struct archive *ar, const char *path)
+{
+	const struct decomp *dc;
+	struct membuf *m;
+	struct filebuf *f;
+	struct stat sb;
+	void *in, *out = NULL;
+	size_t len;
+	int fd;
+
+	if (!decomps[0].name || (fd = open(path, O_RDONLY)) < 0)
+		goto fallback;
+	if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) || sb.st_size == 0) {
+		close(fd);
+		goto fallback;
+	}
+	in = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (in == MAP_FAILED) {
+		close(fd);
+		goto fallback;
+	}
+	for (dc = decomps; dc->name; dc++) {
+		if ((size_t)sb.st_size >= dc->magiclen &&
+		    memcmp(in, dc->magic, dc->magiclen) == 0) {
+			out = dc->decode(in, sb.st_size, &len);
+			break;
+		}
+	}
+	munmap(in, sb.st_size);
+	if (out && cflag)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+	if (!out)
+		goto fallback;
+
+	m = emalloc(sizeof(*m));
+	m->buf = out;
+	m->len = len;
+	m->done = 0;
+	return archive_read_open(ar, m, NULL, mem_read, mem_close);
+
+fallback:
+	if (cflag && (fd = open(path, O_RDONLY)) >= 0) {
+		f = emalloc(sizeof(*f));
+		f->fd = fd;
+		f->off = f->dropped = 0;
+		return archive_read_open(ar, f, NULL, file_read, file_close);
+	}
+	return archive_read_open_filename(ar, path, ARCHIVEBUFSIZ);
+}
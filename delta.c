@@ -0,0 +1,652 @@
+/* See LICENSE file for copyright and license details. */
+#include "pkg.h"
+
+/*
+ * A patch rebuilds a file from the version that is already installed.
+ * It starts with "PKGDIFF1" and the size of the new file, followed by
+ * a sequence of operations:
+ *
+ *	'C' <offset> <length>	copy bytes from the old file
+ *	'A' <length> <data>	add literal bytes
+ *
+ * All numbers are stored as 64-bit little-endian integers.
+ */
+#define DIFFMAGIC "PKGDIFF1"
+#define DIFFBLOCK 64
+
+struct buf {
+	uint8_t *p;
+	size_t len;
+	size_t cap;
+};
+
+struct block {
+	uint32_t sum;			/* weak checksum of the block */
+	size_t off;			/* offset of the block in the old file */
+};
+
+struct patch {
+	char *rpath;			/* relative path of the patched file */
+	char *basesum;			/* sha256 of the installed file */
+	char *newsum;			/* sha256 of the patched file */
+};
+
+struct delta {
+	char *name;
+	char *base;			/* version the delta applies to */
+	char *version;			/* version the delta upgrades to */
+	struct patch *patches;
+	size_t npatches;
+	char **entries;			/* manifest of the new version */
+	char **sorted;			/* the same, sorted for lookups */
+	size_t nentries;
+	char **depends;			/* dependencies of the new version */
+	size_t ndepends;
+};
+
+static void
+buf_put(struct buf *b, const void *p, size_t len)
+{
+	if (b->len + len > b->cap) {
+		b->cap = (b->len + len) * 2;
+		b->p = erealloc(b->p, b->cap);
+	}
+	memcpy(b->p + b->len, p, len);
+	b->len += len;
+}
+
+static void
+buf_put64(struct buf *b, uint64_t v)
+{
+	uint8_t tmp[8];
+	int i;
+
+	for (i = 0; i < 8; i++)
+		tmp[i] = v >> (8 * i);
+	buf_put(b, tmp, sizeof(tmp));
+}
+
+static uint64_t
+get64(const uint8_t *p)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+static void
+diff_add(struct buf *b, const uint8_t *p, size_t len)
+{
+	if (len == 0)
+		return;
+	buf_put(b, "A", 1);
+	buf_put64(b, len);
+	buf_put(b, p, len);
+}
+
+static void
+diff_copy(struct buf *b, size_t off, size_t len)
+{
+	buf_put(b, "C", 1);
+	buf_put64(b, off);
+	buf_put64(b, len);
+}
+
+/* rsync style checksum that can be rolled forward one byte at a time */
+static void
+weaksum(const uint8_t *p, uint32_t *a, uint32_t *s)
+{
+	size_t i;
+
+	*a = *s = 0;
+	for (i = 0; i < DIFFBLOCK; i++) {
+		*a += p[i];
+		*s += (DIFFBLOCK - i) * p[i];
+	}
+}
+
+#define WEAK(a, s)      (((s) << 16) | ((a) & 0xffff))
+#define SLOT(w, mask)   (((w) * 2654435761u) & (mask))
+
+/* Create a patch that turns `old' into `new' */
+void *
+diff_make(const void *old, size_t oldsz, const void *new, size_t newsz,
+	  size_t *patchsz)
+{
+	const uint8_t *o = old, *n = new;
+	struct buf b = { 0 };
+	struct block *tab;
+	size_t nblocks, mask, i, h, lit, off, len;
+	uint32_t a, s, w;
+
+	buf_put(&b, DIFFMAGIC, strlen(DIFFMAGIC));
+	buf_put64(&b, newsz);
+
+	/* index the blocks of the old file by their weak checksum */
+	nblocks = oldsz / DIFFBLOCK;
+	for (mask = 1; mask < nblocks * 2; mask <<= 1)
+		;
+	tab = emalloc(mask * sizeof(*tab));
+	for (i = 0; i < mask; i++)
+		tab[i].off = SIZE_MAX;
+	mask--;
+	for (i = 0; i < nblocks; i++) {
+		weaksum(o + i * DIFFBLOCK, &a, &s);
+		w = WEAK(a, s);
+		for (h = SLOT(w, mask); tab[h].off != SIZE_MAX; h = (h + 1) & mask)
+			if (tab[h].sum == w &&
+			    memcmp(o + tab[h].off, o + i * DIFFBLOCK, DIFFBLOCK) == 0)
+				break;
+		if (tab[h].off == SIZE_MAX) {
+			tab[h].sum = w;
+			tab[h].off = i * DIFFBLOCK;
+		}
+	}
+
+	lit = i = 0;
+	if (nblocks > 0 && newsz >= DIFFBLOCK)
+		weaksum(n, &a, &s);
+	while (nblocks > 0 && i + DIFFBLOCK <= newsz) {
+		w = WEAK(a, s);
+		for (h = SLOT(w, mask); tab[h].off != SIZE_MAX; h = (h + 1) & mask)
+			if (tab[h].sum == w &&
+			    memcmp(o + tab[h].off, n + i, DIFFBLOCK) == 0)
+				break;
+		if (tab[h].off != SIZE_MAX) {
+			/* grow the match in both directions */
+			off = tab[h].off;
+			while (i > lit && off > 0 && o[off - 1] == n[i - 1]) {
+				i--;
+				off--;
+			}
+			for (len = 0; off + len < oldsz && i + len < newsz &&
+			     o[off + len] == n[i + len]; len++)
+				;
+			diff_add(&b, n + lit, i - lit);
+			diff_copy(&b, off, len);
+			i += len;
+			lit = i;
+			if (i + DIFFBLOCK <= newsz)
+				weaksum(n + i, &a, &s);
+			continue;
+		}
+		if (i + DIFFBLOCK < newsz) {
+			a += n[i + DIFFBLOCK] - n[i];
+			s += a - DIFFBLOCK * n[i];
+		}
+		i++;
+	}
+	diff_add(&b, n + lit, newsz - lit);
+
+	free(tab);
+	*patchsz = b.len;
+	return b.p;
+}
+
+/* Apply a patch created by diff_make() to `old' */
+void *
+diff_apply(const void *old, size_t oldsz, const void *patch, size_t patchsz,
+	   size_t *newsz)
+{
+	const uint8_t *o = old, *p = patch, *end = p + patchsz;
+	uint8_t *out;
+	uint64_t sz, off, len, pos = 0;
+
+	if (patchsz < 16 || memcmp(p, DIFFMAGIC, strlen(DIFFMAGIC)) != 0)
+		return NULL;
+	sz = get64(p + 8);
+	p += 16;
+	if (sz > SIZE_MAX - 1)
+		return NULL;
+	out = emalloc(sz + 1);
+
+	while (p < end) {
+		switch (*p++) {
+		case 'C':
+			if (end - p < 16)
+				goto err;
+			off = get64(p);
+			len = get64(p + 8);
+			p += 16;
+			if (off > oldsz || len > oldsz - off || len > sz - pos)
+				goto err;
+			memcpy(out + pos, o + off, len);
+			pos += len;
+			break;
+		case 'A':
+			if (end - p < 8)
+				goto err;
+			len = get64(p);
+			p += 8;
+			if (len > (uint64_t)(end - p) || len > sz - pos)
+				goto err;
+			memcpy(out + pos, p, len);
+			p += len;
+			pos += len;
+			break;
+		default:
+			goto err;
+		}
+	}
+	if (pos != sz)
+		goto err;
+
+	*newsz = sz;
+	return out;
+err:
+	free(out);
+	return NULL;
+}
+
+static void *
+readfile(const char *path, size_t *sz)
+{
+	struct stat sb;
+	uint8_t *p;
+	size_t off = 0;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, &sb) < 0) {
+		close(fd);
+		return NULL;
+	}
+	p = emalloc(sb.st_size + 1);
+	while (off < (size_t)sb.st_size &&
+	       (n = read(fd, p + off, sb.st_size - off)) > 0)
+		off += n;
+	close(fd);
+	if (off != (size_t)sb.st_size) {
+		free(p);
+		return NULL;
+	}
+	*sz = off;
+	return p;
+}
+
+/* Read the data of the current archive entry into memory */
+void *
+readentry(struct archive *ar, struct archive_entry *entry, size_t *sz)
+{
+	uint8_t *p;
+	size_t len = archive_entry_size(entry), off = 0;
+	ssize_t n;
+
+	p = emalloc(len + 1);
+	while (off < len && (n = archive_read_data(ar, p + off, len - off)) > 0)
+		off += n;
+	if (off != len) {
+		weprintf("archive_read_data %s: %s\n",
+			 archive_entry_pathname(entry), archive_error_string(ar));
+		free(p);
+		return NULL;
+	}
+	p[len] = '\0';
+	*sz = len;
+	return p;
+}
+
+static int
+writeall(int fd, const void *p, size_t len)
+{
+	const uint8_t *b = p;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, b, len)) < 0)
+			return -1;
+		b += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+cmpstr(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int
+cmppatch(const void *a, const void *b)
+{
+	return strcmp(((const struct patch *)a)->rpath,
+		      ((const struct patch *)b)->rpath);
+}
+
+/* Check that a path from the metadata stays below the root */
+static int
+safepath(const char *path)
+{
+	const char *p;
+
+	if (path[0] == '/')
+		return 0;
+	p = path;
+	do {
+		if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+			return 0;
+	} while ((p = strchr(p, '/')) && *++p);
+	return 1;
+}
+
+static void
+delta_free(struct delta *d)
+{
+	free(d->entries);
+	free(d->sorted);
+	free(d->depends);
+	free(d->patches);
+}
+
+/* Parse the metadata at the start of a delta package */
+static int
+delta_parse(struct delta *d, char *buf)
+{
+	struct patch *pt;
+	char *line, *next, *val, *p;
+	size_t i;
+
+	memset(d, 0, sizeof(*d));
+	for (line = buf; line && *line; line = next) {
+		if ((next = strchr(line, '\n')))
+			*next++ = '\0';
+		val = strchr(line, ' ');
+		if (val)
+			*val++ = '\0';
+		if (strcmp(line, "name") == 0 && val) {
+			d->name = val;
+		} else if (strcmp(line, "base") == 0) {
+			d->base = val;
+		} else if (strcmp(line, "version") == 0) {
+			d->version = val;
+		} else if (strcmp(line, "depends") == 0 && val) {
+			d->depends = erealloc(d->depends,
+					      (d->ndepends + 1) * sizeof(*d->depends));
+			d->depends[d->ndepends++] = val;
+		} else if (strcmp(line, "entry") == 0 && val) {
+			d->entries = erealloc(d->entries,
+					      (d->nentries + 1) * sizeof(*d->entries));
+			d->entries[d->nentries++] = val;
+		} else if (strcmp(line, "patch") == 0 && val) {
+			d->patches = erealloc(d->patches,
+					      (d->npatches + 1) * sizeof(*d->patches));
+			pt = &d->patches[d->npatches++];
+			pt->basesum = val;
+			if (!(p = strchr(val, ' ')))
+				goto err;
+			*p++ = '\0';
+			pt->newsum = p;
+			if (!(p = strchr(p, ' ')))
+				goto err;
+			*p++ = '\0';
+			/* patched files are opened outside of libarchive */
+			if (!safepath(p)) {
+				weprintf("%s: unsafe path\n", p);
+				goto err;
+			}
+			pt->rpath = p;
+		} else {
+			goto err;
+		}
+	}
+	if (!d->name)
+		goto err;
+	if (d->npatches > 0)
+		qsort(d->patches, d->npatches, sizeof(*d->patches), cmppatch);
+	if (d->nentries > 0) {
+		d->sorted = emalloc(d->nentries * sizeof(*d->sorted));
+		memcpy(d->sorted, d->entries, d->nentries * sizeof(*d->sorted));
+		qsort(d->sorted, d->nentries, sizeof(*d->sorted), cmpstr);
+	}
+	for (i = 0; i < d->npatches; i++) {
+		if (!d->sorted || !bsearch(&d->patches[i].rpath, d->sorted,
+					   d->nentries, sizeof(*d->sorted),
+					   cmpstr)) {
+			weprintf("%s: patch not in the manifest\n",
+				 d->patches[i].rpath);
+			goto err;
+		}
+	}
+	return 0;
+err:
+	delta_free(d);
+	return -1;
+}
+
+/* Rebuild a file from the installed version and a patch in the archive.
+ * The result is checked and renamed over the old file */
+static int
+delta_patch(struct db *db, struct archive *ar, struct archive_entry *entry,
+	    struct patch *pt)
+{
+	char path[PATH_MAX], tmp[PATH_MAX], sum[SHA256_HEX_LENGTH];
+	void *base = NULL, *patch = NULL, *out = NULL;
+	size_t basesz, patchsz, outsz;
+	int fd, r = -1;
+
+	estrlcpy(path, db->root, sizeof(path));
+	estrlcat(path, "/", sizeof(path));
+	estrlcat(path, pt->rpath, sizeof(path));
+	estrlcpy(tmp, path, sizeof(tmp));
+	estrlcat(tmp, ".pkgnew", sizeof(tmp));
+
+	if (!(patch = readentry(ar, entry, &patchsz)))
+		goto out;
+	if (!(base = readfile(path, &basesz))) {
+		weprintf("read %s:", path);
+		goto out;
+	}
+	if (!(out = diff_apply(base, basesz, patch, patchsz, &outsz))) {
+		weprintf("%s: corrupt patch\n", path);
+		goto out;
+	}
+	sha256_hex(out, outsz, sum);
+	if (strcmp(sum, pt->newsum) != 0) {
+		weprintf("%s: checksum mismatch after patching\n", path);
+		goto out;
+	}
+
+	bucket_take(&filelimit, 1);
+	bucket_take(&bytelimit, outsz);
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+		weprintf("open %s:", tmp);
+		goto out;
+	}
+	if (writeall(fd, out, outsz) < 0) {
+		weprintf("write %s:", tmp);
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	fsetmeta(fd, entry, tmp);
+	close(fd);
+	if (rename(tmp, path) < 0) {
+		weprintf("rename %s:", tmp);
+		unlink(tmp);
+		goto out;
+	}
+	if (vflag == 1)
+		printf("patched %s\n", path);
+	r = 0;
+out:
+	free(base);
+	free(patch);
+	free(out);
+	return r;
+}
+
+/* Upgrade an installed package with a delta package */
+int
+delta_install(struct db *db, const char *file)
+{
+	struct archive *ar;
+	struct archive_entry *entry;
+	struct delta d;
+	struct pkg *pkg = NULL, *old;
+	struct pkgentry *pe;
+	struct patch key, *pt;
+	char path[PATH_MAX], sum[SHA256_HEX_LENGTH], cwd[PATH_MAX];
+	char epath[PATH_MAX];
+	char *meta = NULL;
+	const char *tmp;
+	size_t i, sz;
+	int flags, added = 0, r = -1;
+
+	if (!realpath(file, path)) {
+		weprintf("realpath %s:", file);
+		return -1;
+	}
+
+	ar = pkg_archive_new();
+	if (pkg_archive_open(ar, path) < 0) {
+		weprintf("archive_read_open %s: %s\n", path,
+			 archive_error_string(ar));
+		archive_read_free(ar);
+		return -1;
+	}
+	if (archive_read_next_header(ar, &entry) != ARCHIVE_OK ||
+	    strcmp(archive_entry_pathname(entry), DELTAMETA) != 0 ||
+	    !(meta = readentry(ar, entry, &sz)) || delta_parse(&d, meta) < 0) {
+		weprintf("%s: not a delta package\n", path);
+		free(meta);
+		archive_read_free(ar);
+		return -1;
+	}
+
+	old = db_find(db, d.name);
+	if (!old || !version_eq(old->version, d.base)) {
+		weprintf("%s: requires %s%s%s to be installed\n", path, d.name,
+			 d.base ? "#" : "", d.base ? d.base : "");
+		goto err;
+	}
+
+	/* make sure we patch exactly the files the delta was made against */
+	for (i = 0; i < d.npatches; i++) {
+		pt = &d.patches[i];
+		if (rej_match(db, pt->rpath) > 0)
+			continue;
+		pe = pkgentry_new(db, pt->rpath);
+		pkgentry_path(pe, epath);
+		if (sha256_file(epath, sum) < 0 ||
+		    strcmp(sum, pt->basesum) != 0) {
+			weprintf("%s: does not match %s#%s\n", epath,
+				 d.name, d.base ? d.base : "");
+			pkgentry_free(pe);
+			goto err;
+		}
+		pkgentry_free(pe);
+	}
+
+	pkg = pkg_new(path, d.name, d.version);
+	for (i = 0; i < d.nentries; i++) {
+		pe = pkgentry_new(db, d.entries[i]);
+		TAILQ_INSERT_TAIL(&pkg->pe_head, pe, entry);
+	}
+	for (i = 0; i < d.ndepends; i++)
+		pkg_add_depends(pkg, d.depends[i]);
+
+	if (fflag == 0 && pkg_collisions(pkg, old) < 0)
+		goto err;
+
+	if (db_add(db, pkg) < 0)
+		goto err;
+	added = 1;
+
+	if (!getcwd(cwd, sizeof(cwd))) {
+		weprintf("getcwd:");
+		goto err;
+	}
+	if (chdir(db->root) < 0) {
+		weprintf("chdir %s:", db->root);
+		goto err;
+	}
+	while (1) {
+		r = archive_read_next_header(ar, &entry);
+		if (r == ARCHIVE_EOF) {
+			r = 0;
+			break;
+		}
+		if (r != ARCHIVE_OK) {
+			weprintf("archive_read_next_header %s: %s\n",
+				 path, archive_error_string(ar));
+			r = -1;
+			break;
+		}
+		tmp = archive_entry_pathname(entry);
+		if (strncmp(tmp, "./", 2) == 0)
+			tmp += 2;
+		if (strncmp(tmp, DELTAPATCH, strlen(DELTAPATCH)) == 0) {
+			key.rpath = (char *)tmp + strlen(DELTAPATCH);
+			if (rej_match(db, key.rpath) > 0) {
+				weprintf("rejecting %s\n", key.rpath);
+				continue;
+			}
+			pt = d.npatches ? bsearch(&key, d.patches, d.npatches,
+						  sizeof(*d.patches), cmppatch) : NULL;
+			if (!pt) {
+				weprintf("%s: unexpected patch for %s\n",
+					 path, key.rpath);
+				r = -1;
+				break;
+			}
+			if (delta_patch(db, ar, entry, pt) < 0) {
+				r = -1;
+				break;
+			}
+			continue;
+		}
+		/* the manifest is what gets registered, so nothing else
+		 * may end up on disk */
+		if (tmp[0] != '\0' && (!d.sorted ||
+		    !bsearch(&tmp, d.sorted, d.nentries, sizeof(*d.sorted),
+			     cmpstr))) {
+			weprintf("%s: %s is not in the manifest\n", path, tmp);
+			r = -1;
+			break;
+		}
+		if (rej_match(db, archive_entry_pathname(entry)) > 0) {
+			weprintf("rejecting %s\n", archive_entry_pathname(entry));
+			continue;
+		}
+		flags = ARCHIVE_EXTRACT_OWNER | ARCHIVE_EXTRACT_PERM |
+			ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_SECURE_NODOTDOT |
+			ARCHIVE_EXTRACT_UNLINK;
+		bucket_take(&filelimit, 1);
+		if (archive_entry_filetype(entry) == AE_IFREG)
+			bucket_take(&bytelimit, archive_entry_size(entry));
+		r = archive_read_extract(ar, entry, flags);
+		if (r != ARCHIVE_OK && r != ARCHIVE_WARN) {
+			weprintf("archive_read_extract %s: %s\n",
+				 archive_entry_pathname(entry), archive_error_string(ar));
+			r = -1;
+			break;
+		}
+		r = 0;
+	}
+	if (chdir(cwd) < 0)
+		weprintf("chdir %s:", cwd);
+	if (r < 0)
+		goto err;
+
+	if (pkg_replace(db, old, pkg) < 0)
+		r = -1;
+	TAILQ_INSERT_TAIL(&db->pkg_head, pkg, entry);
+	db_own(db, pkg);
+	pkg = NULL;
+err:
+	/* the old version is still the installed one */
+	if (pkg && added && !version_eq(old->version, pkg->version))
+		db_unadd(db, pkg);
+	if (pkg)
+		pkg_free(pkg);
+	delta_free(&d);
+	free(meta);
+	archive_read_free(ar);
+	return r;
+}
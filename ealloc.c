@@ -42,3 +42,58 @@ estrdup(const char *s)
 		eprintf("strdup: out of memory\n");
 	return p;
 }
+
+#define ARENACHUNK (64 * 1024)
+#define ARENAALIGN sizeof(void *)
+/* chunk header, padded so the data following it stays aligned */
+#define CHUNKHDR ((sizeof(struct chunk) + ARENAALIGN - 1) & ~(size_t)(ARENAALIGN - 1))
+
+void *
+arena_alloc(struct arena *a, size_t size)
+{
+	struct chunk *c = a->head;
+	void *p;
+
+	size = (size + ARENAALIGN - 1) & ~(size_t)(ARENAALIGN - 1);
+	if (!c || c->cap - c->len < size) {
+		c = emalloc(CHUNKHDR + MAX(size, ARENACHUNK));
+		c->len = 0;
+		c->cap = MAX(size, ARENACHUNK);
+		c->next = a->head;
+		a->head = c;
+	}
+	p = (char *)c + CHUNKHDR + c->len;
+	c->len += size;
+	a->size += size;
+	return p;
+}
+
+char *
+arena_strdup(struct arena *a, const char *s)
+{
+	return arena_strndup(a, s, strlen(s));
+}
+
+/* Copy the first `len' bytes of `s', which need not be NUL terminated */
+char *
+arena_strndup(struct arena *a, const char *s, size_t len)
+{
+	char *p = arena_alloc(a, len + 1);
+
+	memcpy(p, s, len);
+	p[len] = '\0';
+	return p;
+}
+
+void
+arena_free(struct arena *a)
+{
+	struct chunk *c, *next;
+
+	for (c = a->head; c; c = next) {
+		next = c->next;
+		free(c);
+	}
+	a->head = NULL;
+	a->size = 0;
+}
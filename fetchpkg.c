@@ -0,0 +1,300 @@
+/* See LICENSE file for copyright and license details. */
+#include <curl/curl.h>
+#include "pkg.h"
+
+struct xfer {
+	CURL *curl;
+	FILE *fp;
+	char *url;
+	char name[PATH_MAX];		/* decoded package filename */
+	char part[PATH_MAX];		/* partial download in the cache directory */
+	char path[PATH_MAX];		/* final location in the cache directory */
+	curl_off_t offset;		/* number of bytes we resumed from */
+	struct curl_slist *hdrs;
+};
+
+static CURLM *multi;
+static char *dir = ".";
+static char **urls;
+static int nurls;
+static int active;
+static int errors;
+
+static void
+usage(void)
+{
+	fprintf(stderr, VERSION " (c) 2014 morpheus engineers\n");
+	fprintf(stderr, "usage: %s [-j jobs] [-d dir] [url...]\n", argv0);
+	fprintf(stderr, "  -j    Number of concurrent downloads\n");
+	fprintf(stderr, "  -d    Set the directory packages are stored in\n");
+	exit(EXIT_FAILURE);
+}
+
+/* Return the next url either from the command line or stdin */
+static char *
+nexturl(void)
+{
+	static char *buf = NULL;
+	static size_t sz = 0;
+	ssize_t len;
+
+	if (urls) {
+		if (nurls == 0)
+			return NULL;
+		nurls--;
+		return estrdup(*urls++);
+	}
+
+	while ((len = getline(&buf, &sz, stdin)) != -1) {
+		if (len > 0 && buf[len - 1] == '\n')
+			buf[len - 1] = '\0';
+		if (buf[0] != '\0')
+			return estrdup(buf);
+	}
+	free(buf);
+	buf = NULL;
+	return NULL;
+}
+
+/* Derive the package filename from the last path component of the url */
+static int
+urlname(const char *url, char *name, size_t sz)
+{
+	const char *p, *end;
+	char hex[3] = { 0 };
+	size_t i = 0;
+
+	end = url + strcspn(url, "?");
+	for (p = end; p > url && p[-1] != '/'; p--)
+		;
+	for (; p < end && i < sz - 1; p++) {
+		if (*p == '%' && isxdigit((unsigned char)p[1]) &&
+		    isxdigit((unsigned char)p[2])) {
+			hex[0] = p[1];
+			hex[1] = p[2];
+			name[i++] = strtol(hex, NULL, 16);
+			p += 2;
+		} else {
+			name[i++] = *p;
+		}
+	}
+	name[i] = '\0';
+	if (p != end || name[0] == '\0' || name[0] == '.' ||
+	    strchr(name, '/'))
+		return -1;
+	return 0;
+}
+
+static size_t
+write_cb(char *ptr, size_t size, size_t nmemb, void *data)
+{
+	struct xfer *x = data;
+
+	return fwrite(ptr, size, nmemb, x->fp);
+}
+
+/* Queue `x' on the multi handle, resuming any partial download.  The
+ * partial file carries the modification time of the package on the
+ * server, so it is only resumed if the package did not change since */
+static int
+xfer_start(struct xfer *x)
+{
+	struct stat sb;
+	struct tm tm;
+	char hdr[64];
+
+	if (!(x->fp = fopen(x->part, "ab"))) {
+		weprintf("fopen %s:", x->part);
+		return -1;
+	}
+	if (fseeko(x->fp, 0, SEEK_END) < 0) {
+		weprintf("fseeko %s:", x->part);
+		fclose(x->fp);
+		return -1;
+	}
+	x->offset = ftello(x->fp);
+
+	curl_slist_free_all(x->hdrs);
+	x->hdrs = NULL;
+	if (x->offset > 0 && fstat(fileno(x->fp), &sb) == 0 &&
+	    gmtime_r(&sb.st_mtime, &tm)) {
+		strftime(hdr, sizeof(hdr), "If-Range: %a, %d %b %Y %H:%M:%S GMT", &tm);
+		x->hdrs = curl_slist_append(NULL, hdr);
+	}
+
+	curl_easy_reset(x->curl);
+	curl_easy_setopt(x->curl, CURLOPT_URL, x->url);
+	curl_easy_setopt(x->curl, CURLOPT_PRIVATE, x);
+	curl_easy_setopt(x->curl, CURLOPT_WRITEFUNCTION, write_cb);
+	curl_easy_setopt(x->curl, CURLOPT_WRITEDATA, x);
+	curl_easy_setopt(x->curl, CURLOPT_FAILONERROR, 1L);
+	curl_easy_setopt(x->curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(x->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(x->curl, CURLOPT_RESUME_FROM_LARGE, x->offset);
+	curl_easy_setopt(x->curl, CURLOPT_HTTPHEADER, x->hdrs);
+	curl_easy_setopt(x->curl, CURLOPT_FILETIME, 1L);
+	curl_multi_add_handle(multi, x->curl);
+	active++;
+	return 0;
+}
+
+/* Pick up the next url that isn't already in the cache */
+static void
+xfer_next(struct xfer *x)
+{
+	char *url;
+
+	while ((url = nexturl())) {
+		if (urlname(url, x->name, sizeof(x->name)) < 0) {
+			weprintf("%s: invalid package url\n", url);
+			free(url);
+			errors++;
+			continue;
+		}
+		estrlcpy(x->path, dir, sizeof(x->path));
+		estrlcat(x->path, "/", sizeof(x->path));
+		estrlcat(x->path, x->name, sizeof(x->path));
+		if (access(x->path, F_OK) == 0) {
+			puts(x->name);
+			fflush(stdout);
+			free(url);
+			continue;
+		}
+		estrlcpy(x->part, dir, sizeof(x->part));
+		estrlcat(x->part, "/.", sizeof(x->part));
+		estrlcat(x->part, x->name, sizeof(x->part));
+		estrlcat(x->part, ".part", sizeof(x->part));
+
+		x->url = url;
+		if (xfer_start(x) == 0)
+			return;
+		free(url);
+		errors++;
+	}
+	x->url = NULL;
+}
+
+static void
+xfer_done(struct xfer *x, CURLcode res)
+{
+	struct stat sb;
+	struct timespec ts[2];
+	curl_off_t mtime = -1;
+	long code = 0;
+	int r;
+
+	curl_multi_remove_handle(multi, x->curl);
+	active--;
+
+	r = fflush(x->fp);
+	if (r == 0 && fsync(fileno(x->fp)) < 0)
+		weprintf("fsync %s:", x->part);
+	if (fclose(x->fp) == EOF || r == EOF) {
+		weprintf("write %s:", x->part);
+		res = CURLE_WRITE_ERROR;
+	}
+
+	curl_easy_getinfo(x->curl, CURLINFO_RESPONSE_CODE, &code);
+	curl_easy_getinfo(x->curl, CURLINFO_FILETIME_T, &mtime);
+	if (mtime >= 0) {
+		ts[0].tv_nsec = UTIME_OMIT;
+		ts[1].tv_sec = mtime;
+		ts[1].tv_nsec = 0;
+		utimensat(AT_FDCWD, x->part, ts, 0);
+	}
+	/* the server can't resume, the package changed or the partial file
+	 * is no prefix of it, start over.  libcurl takes a 416 for a
+	 * complete download, but nothing tells that from a stale partial
+	 * file that is too large */
+	if ((code == 416 || res == CURLE_RANGE_ERROR) && x->offset > 0 &&
+	    truncate(x->part, 0) == 0) {
+		if (xfer_start(x) == 0)
+			return;
+		res = CURLE_WRITE_ERROR;
+	}
+
+	if (res != CURLE_OK) {
+		weprintf("%s: %s\n", x->url, curl_easy_strerror(res));
+		/* keep partial downloads around so they can be resumed */
+		if (stat(x->part, &sb) == 0 && sb.st_size == 0)
+			unlink(x->part);
+		errors++;
+	} else if (rename(x->part, x->path) < 0) {
+		weprintf("rename %s:", x->part);
+		errors++;
+	} else {
+		puts(x->name);
+		fflush(stdout);
+	}
+
+	curl_slist_free_all(x->hdrs);
+	x->hdrs = NULL;
+	free(x->url);
+	xfer_next(x);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct xfer *xfers;
+	struct CURLMsg *msg;
+	struct xfer *x;
+	int njobs = 4;
+	int i, n;
+
+	ARGBEGIN {
+	case 'j':
+		njobs = estrtol(EARGF(usage()), 10);
+		break;
+	case 'd':
+		dir = EARGF(usage());
+		break;
+	default:
+		usage();
+	} ARGEND;
+
+	if (njobs < 1)
+		usage();
+	if (argc > 0) {
+		urls = argv;
+		nurls = argc;
+	}
+
+	if (curl_global_init(CURL_GLOBAL_DEFAULT) != 0)
+		eprintf("curl_global_init: failed\n");
+	multi = curl_multi_init();
+	if (!multi)
+		eprintf("curl_multi_init: failed\n");
+	/* keep connections alive and reuse them across packages */
+	curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)njobs);
+	curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)njobs);
+
+	xfers = ecalloc(njobs, sizeof(*xfers));
+	for (i = 0; i < njobs; i++) {
+		if (!(xfers[i].curl = curl_easy_init()))
+			eprintf("curl_easy_init: failed\n");
+		xfer_next(&xfers[i]);
+	}
+
+	while (active > 0) {
+		if (curl_multi_perform(multi, &n) != CURLM_OK)
+			eprintf("curl_multi_perform: failed\n");
+		while ((msg = curl_multi_info_read(multi, &n))) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&x);
+			xfer_done(x, msg->data.result);
+		}
+		if (active > 0 &&
+		    curl_multi_poll(multi, NULL, 0, 1000, NULL) != CURLM_OK)
+			eprintf("curl_multi_poll: failed\n");
+	}
+
+	for (i = 0; i < njobs; i++)
+		curl_easy_cleanup(xfers[i].curl);
+	free(xfers);
+	curl_multi_cleanup(multi);
+	curl_global_cleanup();
+
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
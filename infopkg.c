@@ -2,30 +2,80 @@
 #include "pkg.h"
 
 static int own_pkg_cb(struct db *, struct pkg *, void *);
+static int pkgd_copy(const char *, const char *, const char *);
+static int own_stream(const char *, int);
+static int list_files(const char *, const char *);
+static int list_pkgs(const char *);
+static int own_prefix(const char *, const char *);
+
+/* A canonical path and the package owning it */
+struct ownedpath {
+	char *path;
+	struct pkg *pkg;
+};
+
+/* Inputs are resolved and merged against the db in chunks of this size */
+#define CHUNKSIZ 65536
+
+/* Cached per package totals, valid as long as the inode and ctime of
+ * the db entry are unchanged.  db_add() replaces entries by renaming a
+ * new file over them, so any change to a package gives it a new inode,
+ * but a freed inode number may be handed out again */
+#define SUMMARY ".summary"
+
+struct summary {
+	char *file;
+	ino_t ino;
+	int64_t ctime;			/* in nanoseconds */
+	size_t nfiles;
+	long long size;
+};
 
 static void
 usage(void)
 {
 	fprintf(stderr, VERSION " (c) 2014 morpheus engineers\n");
-	fprintf(stderr, "usage: %s [-r path] [-o filename...]\n", argv0);
+	fprintf(stderr, "usage: %s [-r path] [-o filename... | -s [-0] | -p dir | -l name | -a]\n", argv0);
 	fprintf(stderr, "  -r	 Set alternative installation root\n");
+	fprintf(stderr, "  -a	 List installed packages with their file count and size\n");
+	fprintf(stderr, "  -l	 List the files of the given package\n");
+	fprintf(stderr, "  -p	 List the packages owning anything below the given directory\n");
 	fprintf(stderr, "  -o	 Look for the packages that own the given filename(s)\n");
+	fprintf(stderr, "  -s	 Read the filenames to look for from stdin\n");
+	fprintf(stderr, "  -0	 Filenames read from stdin are NUL separated\n");
 	exit(EXIT_FAILURE);
 }
 
 int
 main(int argc, char *argv[])
 {
-	struct db *db;
-	char path[PATH_MAX];
+	struct db *db = NULL;
+	struct stat sb;
+	char path[PATH_MAX], query[PATH_MAX + 64];
 	char *root = "/";
-	int oflag = 0;
+	char *lname = NULL, *prefix = NULL;
+	int oflag = 0, sflag = 0, allflag = 0, delim = '\n';
 	int i, r;
 
 	ARGBEGIN {
+	case 'a':
+		allflag = 1;
+		break;
+	case 'l':
+		lname = EARGF(usage());
+		break;
+	case 'p':
+		prefix = EARGF(usage());
+		break;
 	case 'o':
 		oflag = 1;
 		break;
+	case 's':
+		sflag = 1;
+		break;
+	case '0':
+		delim = '\0';
+		break;
 	case 'r':
 		root = ARGF();
 		break;
@@ -33,40 +83,97 @@ main(int argc, char *argv[])
 		usage();
 	} ARGEND;
 
-	if (oflag == 0 || argc < 1)
-		usage();
+	if (allflag == 1) {
+		if (oflag == 1 || sflag == 1 || lname || argc > 0)
+			usage();
+		return list_pkgs(root) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
 
-	db = db_new(root);
-	if (!db)
-		exit(EXIT_FAILURE);
-	r = db_load(db);
-	if (r < 0) {
-		db_free(db);
-		exit(EXIT_FAILURE);
+	if (prefix) {
+		if (oflag == 1 || sflag == 1 || lname || argc > 0)
+			usage();
+		return own_prefix(root, prefix) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 	}
 
+	if (lname) {
+		if (oflag == 1 || sflag == 1 || argc > 0)
+			usage();
+		return list_files(root, lname) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (sflag == 1) {
+		if (oflag == 1 || argc > 0)
+			usage();
+		return own_stream(root, delim) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (oflag == 0 || argc < 1)
+		usage();
+
 	for (i = 0; i < argc; i++) {
 		if (!realpath(argv[i], path)) {
 			weprintf("realpath %s:", argv[i]);
-			db_free(db);
-			exit(EXIT_FAILURE);
+			goto err;
 		}
-		r = db_walk(db, own_pkg_cb, path);
-		if (r < 0) {
-			db_free(db);
-			exit(EXIT_FAILURE);
+		/* ask pkgd first and only load the db if it is not running.
+		 * It is told which file is meant rather than looking it up
+		 * itself, as it may see more than we are allowed to */
+		if (!db) {
+			if (lstat(path, &sb) < 0) {
+				weprintf("lstat %s:", path);
+				goto err;
+			}
+			snprintf(query, sizeof(query), "%ju %ju %s",
+				 (uintmax_t)sb.st_dev, (uintmax_t)sb.st_ino, path);
+			r = pkgd_copy(root, "own", query);
+			if (r > 0)
+				goto err;
+			if (r == 0)
+				continue;
+			db = db_new(root);
+			if (!db)
+				exit(EXIT_FAILURE);
+			r = db_load(db);
+			if (r < 0)
+				goto err;
 		}
+		r = db_walk(db, own_pkg_cb, path);
+		if (r < 0)
+			goto err;
 	}
 
-	db_free(db);
+	if (db)
+		db_free(db);
 
 	return EXIT_SUCCESS;
+err:
+	if (db)
+		db_free(db);
+	exit(EXIT_FAILURE);
+}
+
+/* Copy the response of a pkgd query to stdout */
+static int
+pkgd_copy(const char *root, const char *cmd, const char *arg)
+{
+	FILE *fp;
+	char buf[BUFSIZ];
+	size_t n;
+	int r;
+
+	r = pkgd_query(root, &fp, cmd, arg);
+	if (r != 0)
+		return r;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		fwrite(buf, 1, n, stdout);
+	fclose(fp);
+	return 0;
 }
 
 static int
 own_pkg_cb(struct db *db, struct pkg *pkg, void *file)
 {
-	char *path = file;
+	char *path = file, pepath[PATH_MAX];
 	struct pkgentry *pe;
 	struct stat sb1, sb2;
 
@@ -76,8 +183,8 @@ own_pkg_cb(struct db *db, struct pkg *pkg, void *file)
 		eprintf("lstat %s:", path);
 
 	TAILQ_FOREACH(pe, &pkg->pe_head, entry) {
-		if (lstat(pe->path, &sb2) < 0) {
-			weprintf("lstat %s:", pe->path);
+		if (lstat(pkgentry_path(pe, pepath), &sb2) < 0) {
+			weprintf("lstat %s:", pepath);
 			continue;
 		}
 		if (sb1.st_dev == sb2.st_dev &&
@@ -88,3 +195,420 @@ own_pkg_cb(struct db *db, struct pkg *pkg, void *file)
 	}
 	return 0;
 }
+
+/* Resolve every directory leading up to `path' but keep the last
+ * component, so symlinks are owned as themselves.  `out' must not
+ * overlap `path'.  The last resolved directory is cached in `dir' and
+ * `rdir' as consecutive paths mostly share it */
+static void
+canonpath(const char *path, char *out, size_t sz, char *dir, char *rdir)
+{
+	char tmp[PATH_MAX], *base;
+	size_t len;
+
+	estrlcpy(tmp, path, sizeof(tmp));
+	len = strlen(tmp);
+	while (len > 1 && tmp[len - 1] == '/')
+		tmp[--len] = '\0';
+	if ((base = strrchr(tmp, '/'))) {
+		*base++ = '\0';
+		if (!tmp[0])
+			estrlcpy(tmp, "/", sizeof(tmp));
+	} else {
+		base = tmp;
+	}
+	if (!base[0] || strcmp(base, ".") == 0 || strcmp(base, "..") == 0) {
+		/* nothing to keep, resolve the whole path */
+		if (!realpath(path, out))
+			estrlcpy(out, path, sz);
+		return;
+	}
+
+	if (base == tmp) {
+		if (strcmp(dir, ".") != 0) {
+			estrlcpy(dir, ".", PATH_MAX);
+			if (!realpath(".", rdir))
+				estrlcpy(rdir, ".", PATH_MAX);
+		}
+	} else if (strcmp(dir, tmp) != 0) {
+		estrlcpy(dir, tmp, PATH_MAX);
+		if (!realpath(dir, rdir))
+			estrlcpy(rdir, dir, PATH_MAX);
+	}
+	estrlcpy(out, rdir, sz);
+	if (strcmp(rdir, "/") != 0)
+		estrlcat(out, "/", sz);
+	estrlcat(out, base, sz);
+}
+
+static int
+cmpowner(const void *a, const void *b)
+{
+	return strcmp(((const struct ownedpath *)a)->path,
+		      ((const struct ownedpath *)b)->path);
+}
+
+static int
+cmppath(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Merge a sorted chunk of input paths against the sorted owner table */
+static void
+own_merge(struct ownedpath *tab, size_t ntab, char **in, size_t nin)
+{
+	size_t i, j = 0, k;
+	int c = 0;
+
+	for (i = 0; i < nin; i++) {
+		while (j < ntab && (c = strcmp(tab[j].path, in[i])) < 0)
+			j++;
+		if (j == ntab || c > 0) {
+			printf("%s is not owned by any package\n", in[i]);
+			continue;
+		}
+		for (k = j; k < ntab && strcmp(tab[k].path, in[i]) == 0; k++)
+			if (k == j || tab[k].pkg != tab[k - 1].pkg)
+				printf("%s is owned by %s\n", in[i], tab[k].pkg->name);
+	}
+}
+
+/* Look up owners for paths read from stdin.  The db's paths are
+ * canonicalized and sorted once, then each chunk of input is sorted
+ * and merged against them, so memory use is bound by the db plus a
+ * single chunk no matter how many paths are read */
+static int
+own_stream(const char *root, int delim)
+{
+	struct db *db;
+	struct pkg *pkg;
+	struct pkgentry *pe;
+	struct ownedpath *tab = NULL;
+	char **in;
+	char dir[PATH_MAX] = "", rdir[PATH_MAX];
+	char path[PATH_MAX], epath[PATH_MAX];
+	char *buf = NULL;
+	size_t ntab = 0, tabsz = 0, nin = 0, sz = 0, i;
+	ssize_t len;
+	int r = 0;
+
+	db = db_new(root);
+	if (!db)
+		return -1;
+	if (db_load(db) < 0) {
+		db_free(db);
+		return -1;
+	}
+
+	TAILQ_FOREACH(pkg, &db->pkg_head, entry) {
+		TAILQ_FOREACH(pe, &pkg->pe_head, entry) {
+			if (ntab == tabsz) {
+				tabsz = tabsz ? tabsz * 2 : 1024;
+				tab = erealloc(tab, tabsz * sizeof(*tab));
+			}
+			canonpath(pkgentry_path(pe, epath), path, sizeof(path),
+				  dir, rdir);
+			tab[ntab].path = estrdup(path);
+			tab[ntab].pkg = pkg;
+			ntab++;
+		}
+	}
+	qsort(tab, ntab, sizeof(*tab), cmpowner);
+
+	in = emalloc(CHUNKSIZ * sizeof(*in));
+	dir[0] = '\0';
+	for (;;) {
+		len = getdelim(&buf, &sz, delim, stdin);
+		if (len > 0 && buf[len - 1] == delim)
+			buf[--len] = '\0';
+		if (len > 0) {
+			canonpath(buf, path, sizeof(path), dir, rdir);
+			in[nin++] = estrdup(path);
+		}
+		if (nin == CHUNKSIZ || (len < 0 && nin > 0)) {
+			qsort(in, nin, sizeof(*in), cmppath);
+			own_merge(tab, ntab, in, nin);
+			for (i = 0; i < nin; i++)
+				free(in[i]);
+			nin = 0;
+		}
+		if (len < 0)
+			break;
+	}
+	if (ferror(stdin)) {
+		weprintf("read error:");
+		r = -1;
+	}
+
+	free(buf);
+	free(in);
+	for (i = 0; i < ntab; i++)
+		free(tab[i].path);
+	free(tab);
+	db_free(db);
+	return r;
+}
+
+static int
+list_files(const char *root, const char *name)
+{
+	struct db *db;
+	struct pkg *pkg;
+	struct pkgentry *pe;
+	char path[PATH_MAX], file[PATH_MAX];
+	int r;
+
+	r = pkgd_copy(root, "files", name);
+	if (r >= 0)
+		return r > 0 ? -1 : 0;
+
+	db = db_new(root);
+	if (!db)
+		return -1;
+	/* only the package asked for is loaded */
+	if (db_lookup(db, name, file, sizeof(file)) < 0) {
+		weprintf("%s is not installed\n", name);
+		db_free(db);
+		return -1;
+	}
+	if (!(pkg = pkg_load(db, file))) {
+		db_free(db);
+		return -1;
+	}
+	TAILQ_FOREACH(pe, &pkg->pe_head, entry)
+		puts(pkgentry_path(pe, path));
+	pkg_free(pkg);
+	db_free(db);
+	return 0;
+}
+
+static int
+cmpsummary(const void *a, const void *b)
+{
+	return strcmp(((const struct summary *)a)->file,
+		      ((const struct summary *)b)->file);
+}
+
+static struct summary *
+summary_load(struct db *db, size_t *n)
+{
+	struct summary *sum = NULL, s;
+	char path[PATH_MAX], file[PATH_MAX];
+	unsigned long long ino;
+	long long ctime;
+	size_t sz = 0;
+	FILE *fp;
+
+	*n = 0;
+	estrlcpy(path, db->path, sizeof(path));
+	estrlcat(path, "/" SUMMARY, sizeof(path));
+	if (!(fp = fopen(path, "r")))
+		return NULL;
+	while (fscanf(fp, "%llu %lld %zu %lld %4095s", &ino, &ctime,
+		      &s.nfiles, &s.size, file) == 5) {
+		if (*n == sz) {
+			sz = sz ? sz * 2 : 64;
+			sum = erealloc(sum, sz * sizeof(*sum));
+		}
+		s.ino = ino;
+		s.ctime = ctime;
+		s.file = estrdup(file);
+		sum[(*n)++] = s;
+	}
+	fclose(fp);
+	if (*n > 0)
+		qsort(sum, *n, sizeof(*sum), cmpsummary);
+	return sum;
+}
+
+/* Rewrite the summary.  It is only a cache, so failing to write it,
+ * e.g. when not running as root, is not an error */
+static void
+summary_save(struct db *db, struct summary *sum, size_t n)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	FILE *fp;
+	size_t i;
+
+	estrlcpy(path, db->path, sizeof(path));
+	estrlcat(path, "/" SUMMARY, sizeof(path));
+	estrlcpy(tmp, path, sizeof(tmp));
+	estrlcat(tmp, ".tmp", sizeof(tmp));
+	if (!(fp = fopen(tmp, "w")))
+		return;
+	for (i = 0; i < n; i++)
+		fprintf(fp, "%llu %lld %zu %lld %s\n",
+			(unsigned long long)sum[i].ino, (long long)sum[i].ctime,
+			sum[i].nfiles, sum[i].size, sum[i].file);
+	if (fclose(fp) == EOF || rename(tmp, path) < 0)
+		unlink(tmp);
+}
+
+/* Count the files of a package and add up the size of its regular files */
+static int
+summary_make(struct db *db, const char *file, struct summary *s)
+{
+	struct pkg *pkg;
+	struct pkgentry *pe;
+	struct stat sb;
+	char path[PATH_MAX];
+
+	if (!(pkg = pkg_load(db, file)))
+		return -1;
+	s->nfiles = 0;
+	s->size = 0;
+	TAILQ_FOREACH(pe, &pkg->pe_head, entry) {
+		s->nfiles++;
+		if (lstat(pkgentry_path(pe, path), &sb) == 0 && S_ISREG(sb.st_mode))
+			s->size += sb.st_size;
+	}
+	pkg_free(pkg);
+	return 0;
+}
+
+/* List installed packages.  Only the db entries that changed since the
+ * summary was written are parsed, everything else comes from db_next() */
+static int
+list_pkgs(const char *root)
+{
+	struct db *db;
+	struct dirent *dp;
+	struct summary *old, *new = NULL, *s, key;
+	struct stat sb;
+	char path[PATH_MAX];
+	const char *version;
+	int64_t ctime;
+	size_t nold, nnew = 0, sz = 0, len, i;
+	int dirty = 0;
+
+	db = db_new(root);
+	if (!db)
+		return -1;
+	old = summary_load(db, &nold);
+
+	db_rewind(db);
+	while ((dp = db_next(db))) {
+		if (nnew == sz) {
+			sz = sz ? sz * 2 : 64;
+			new = erealloc(new, sz * sizeof(*new));
+		}
+		if (stat(db_entrypath(db, dp->d_name, path), &sb) < 0) {
+			weprintf("stat %s:", path);
+			continue;
+		}
+		ctime = (int64_t)sb.st_ctim.tv_sec * 1000000000 +
+			sb.st_ctim.tv_nsec;
+		key.file = dp->d_name;
+		s = nold ? bsearch(&key, old, nold, sizeof(*old), cmpsummary) : NULL;
+		if (s && s->ino == sb.st_ino && s->ctime == ctime) {
+			new[nnew] = *s;
+			new[nnew].file = estrdup(s->file);
+		} else {
+			new[nnew].file = estrdup(dp->d_name);
+			new[nnew].ino = sb.st_ino;
+			new[nnew].ctime = ctime;
+			if (summary_make(db, dp->d_name, &new[nnew]) < 0) {
+				free(new[nnew].file);
+				continue;
+			}
+			dirty = 1;
+		}
+		nnew++;
+	}
+	if (nnew > 0)
+		qsort(new, nnew, sizeof(*new), cmpsummary);
+	if (dirty || nnew != nold)
+		summary_save(db, new, nnew);
+
+	for (i = 0; i < nnew; i++) {
+		len = parse_db_entry(new[i].file, &version);
+		printf("%.*s %s %zu %lld\n", (int)len, new[i].file,
+		       version ? version : "-", new[i].nfiles, new[i].size);
+	}
+
+	for (i = 0; i < nold; i++)
+		free(old[i].file);
+	for (i = 0; i < nnew; i++)
+		free(new[i].file);
+	free(old);
+	free(new);
+	db_free(db);
+	return 0;
+}
+
+struct prefix {
+	struct pkg **pkgs;
+	size_t n;
+};
+
+static int
+prefix_cb(struct pathnode *n, void *data)
+{
+	struct prefix *p = data;
+	struct owner *o;
+	size_t i;
+
+	for (o = n->owners; o; o = o->next) {
+		for (i = 0; i < p->n; i++)
+			if (p->pkgs[i] == o->pkg)
+				break;
+		if (i == p->n) {
+			p->pkgs = erealloc(p->pkgs, (p->n + 1) * sizeof(*p->pkgs));
+			p->pkgs[p->n++] = o->pkg;
+		}
+	}
+	return 0;
+}
+
+static int
+cmpname(const void *a, const void *b)
+{
+	return strcmp((*(struct pkg *const *)a)->name,
+		      (*(struct pkg *const *)b)->name);
+}
+
+/* List the packages owning `dir' or anything below it, found by walking
+ * the subtree of `dir' in the path trie of the db */
+static int
+own_prefix(const char *root, const char *dir)
+{
+	struct db *db;
+	struct pathnode *n;
+	struct prefix p = { NULL, 0 };
+	char path[PATH_MAX];
+	const char *rpath;
+	size_t i, rootlen;
+
+	db = db_new(root);
+	if (!db)
+		return -1;
+	if (db_load(db) < 0) {
+		db_free(db);
+		return -1;
+	}
+
+	if (!realpath(dir, path))
+		estrlcpy(path, dir, sizeof(path));
+	rootlen = strlen(db->root);
+	if (strcmp(db->root, "/") == 0)
+		rootlen = 0;
+	if (path[0] != '/' || strncmp(path, db->root, rootlen) != 0 ||
+	    (path[rootlen] != '/' && path[rootlen] != '\0')) {
+		weprintf("%s: not below %s\n", path, db->root);
+		db_free(db);
+		return -1;
+	}
+	rpath = path + rootlen;
+
+	if ((n = path_lookup(db, rpath)))
+		path_subtree(n, prefix_cb, &p);
+	if (p.n > 0)
+		qsort(p.pkgs, p.n, sizeof(*p.pkgs), cmpname);
+	for (i = 0; i < p.n; i++)
+		puts(p.pkgs[i]->name);
+
+	free(p.pkgs);
+	db_free(db);
+	return 0;
+}
@@ -1,14 +1,31 @@
 /* See LICENSE file for copyright and license details. */
 #include "pkg.h"
 
+static int install_fd(struct db *, const char *, int);
+static int install_pkgs(struct db *, struct pkg **, size_t, long);
+
+static int uflag = 0;
+
 static void
 usage(void)
 {
 	fprintf(stderr, VERSION " (c) 2014 morpheus engineers\n");
-	fprintf(stderr, "usage: %s [-v] [-f] [-r path] pkg...\n", argv0);
+	fprintf(stderr, "usage: %s [-v] [-f] [-a | -A] [-d | -u] [-j jobs] [-c | -w writers] [-B rate] [-F rate] [-r path] pkg...\n", argv0);
+	fprintf(stderr, "       %s [-v] [-f] [-a | -A] [-u] [-c | -w writers] [-B rate] [-F rate] [-r path] [-i fd] -s name[#version]\n", argv0);
 	fprintf(stderr, "  -v    Enable verbose output\n");
 	fprintf(stderr, "  -f    Override filesystem checks and force installation\n");
+	fprintf(stderr, "  -a    Extract each file to a temporary name and rename it into place\n");
+	fprintf(stderr, "  -A    Like -a, but rename all files into place at the end of each package\n");
+	fprintf(stderr, "  -d    Upgrade installed packages with delta packages\n");
+	fprintf(stderr, "  -u    Upgrade installed packages, only rewriting changed files\n");
+	fprintf(stderr, "  -j    Install up to jobs packages in parallel\n");
+	fprintf(stderr, "  -c    Keep the page cache and dirty memory small while installing\n");
+	fprintf(stderr, "  -w    Write the files of a package with writers threads\n");
+	fprintf(stderr, "  -B    Write at most rate bytes per second\n");
+	fprintf(stderr, "  -F    Create at most rate files per second\n");
 	fprintf(stderr, "  -r    Set alternative installation root\n");
+	fprintf(stderr, "  -s    Install the named package from a stream\n");
+	fprintf(stderr, "  -i    Read the stream from fd instead of stdin\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -16,10 +33,14 @@ int
 main(int argc, char *argv[])
 {
 	struct db *db;
-	struct pkg *pkg;
+	struct pkg **pkgs;
 	char path[PATH_MAX];
 	char *root = "/";
-	int i;
+	char *sname = NULL;
+	long jobs = 1;
+	int fd = STDIN_FILENO;
+	int dflag = 0;
+	int i, r;
 
 	ARGBEGIN {
 	case 'v':
@@ -28,15 +49,55 @@ main(int argc, char *argv[])
 	case 'f':
 		fflag = 1;
 		break;
+	case 'a':
+		aflag = ATOMIC_FILE;
+		break;
+	case 'A':
+		aflag = ATOMIC_BATCH;
+		break;
+	case 'd':
+		dflag = 1;
+		break;
+	case 'u':
+		uflag = 1;
+		break;
 	case 'r':
 		root = ARGF();
 		break;
+	case 's':
+		sname = EARGF(usage());
+		break;
+	case 'i':
+		fd = estrtol(EARGF(usage()), 10);
+		break;
+	case 'j':
+		jobs = estrtol(EARGF(usage()), 10);
+		if (jobs < 1)
+			usage();
+		break;
+	case 'c':
+		cflag = 1;
+		break;
+	case 'w':
+		nwriters = estrtol(EARGF(usage()), 10);
+		if (nwriters < 1)
+			usage();
+		break;
+	case 'B':
+		bucket_set(&bytelimit, parse_rate(EARGF(usage())));
+		break;
+	case 'F':
+		bucket_set(&filelimit, parse_rate(EARGF(usage())));
+		break;
 	default:
 		usage();
 	} ARGEND;
 
-	if (argc < 1)
+	if ((sname && (argc > 0 || dflag)) || (!sname && argc < 1) ||
+	    (dflag && uflag) || (cflag && nwriters > 1))
 		usage();
+	if (vflag == 1)
+		atexit(bucket_report);
 
 	db = db_new(root);
 	if (!db)
@@ -46,37 +107,274 @@ main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	for (i = 0; i < argc; i++) {
-		if (!realpath(argv[i], path)) {
-			weprintf("realpath %s:", argv[i]);
-			db_free(db);
-			exit(EXIT_FAILURE);
-		}
-		if (vflag == 1)
-			printf("installing %s\n", path);
-		pkg = pkg_load_file(db, path);
-		if (!pkg) {
-			db_free(db);
-			exit(EXIT_FAILURE);
-		}
-		if (fflag == 0) {
-			if (pkg_collisions(pkg) < 0) {
+	if (sname) {
+		i = install_fd(db, sname, fd);
+		db_free(db);
+		return i < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (dflag == 1) {
+		for (i = 0; i < argc; i++) {
+			if (!realpath(argv[i], path)) {
+				weprintf("realpath %s:", argv[i]);
+				db_free(db);
+				exit(EXIT_FAILURE);
+			}
+			if (vflag == 1)
+				printf("installing %s\n", path);
+			if (delta_install(db, path) < 0) {
 				printf("not installed %s\n", path);
 				db_free(db);
 				exit(EXIT_FAILURE);
 			}
+			printf("installed %s\n", path);
 		}
-		if (db_add(db, pkg) < 0) {
+		db_free(db);
+		return EXIT_SUCCESS;
+	}
+
+	pkgs = emalloc(argc * sizeof(*pkgs));
+	for (i = 0; i < argc; i++) {
+		pkgs[i] = pkg_load_file(db, argv[i]);
+		if (!pkgs[i]) {
+			while (i-- > 0)
+				pkg_free(pkgs[i]);
+			free(pkgs);
 			db_free(db);
 			exit(EXIT_FAILURE);
 		}
-		if (pkg_install(db, pkg) < 0) {
-			db_free(db);
-			exit(EXIT_FAILURE);
+	}
+	r = install_pkgs(db, pkgs, argc, jobs);
+	for (i = 0; i < argc; i++)
+		pkg_free(pkgs[i]);
+	free(pkgs);
+	db_free(db);
+	return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int
+install_pkg(struct db *db, struct pkg *pkg)
+{
+	struct pkg *old;
+
+	if (vflag == 1)
+		printf("installing %s\n", pkg->path);
+	old = uflag ? db_find(db, pkg->name) : NULL;
+	if (fflag == 0) {
+		if (pkg_collisions(pkg, old) < 0) {
+			printf("not installed %s\n", pkg->path);
+			return -1;
 		}
-		printf("installed %s\n", path);
 	}
+	if (pkg_add(db, pkg, old) < 0)
+		return -1;
+	printf("installed %s\n", pkg->path);
+	return 0;
+}
 
-	db_free(db);
-	return EXIT_SUCCESS;
+static int
+cmpnode(const void *a, const void *b)
+{
+	uintptr_t x = (uintptr_t)(*(struct pkgentry *const *)a)->node;
+	uintptr_t y = (uintptr_t)(*(struct pkgentry *const *)b)->node;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Packages installed at the same time only see each other's files once
+ * they are on disk, so check for collisions among them up front.  All
+ * entries share the path trie of the db, so equal paths are equal nodes */
+static int
+batch_collisions(struct pkg **pkgs, size_t n)
+{
+	struct pkgentry **pes = NULL, *pe;
+	struct stat sb;
+	char path[PATH_MAX];
+	size_t npes = 0, i;
+	int r = 0;
+
+	for (i = 0; i < n; i++) {
+		TAILQ_FOREACH(pe, &pkgs[i]->pe_head, entry) {
+			pes = erealloc(pes, (npes + 1) * sizeof(*pes));
+			pes[npes++] = pe;
+		}
+	}
+	qsort(pes, npes, sizeof(*pes), cmpnode);
+	for (i = 1; i < npes; i++) {
+		if (pes[i]->dir || pes[i - 1]->node != pes[i]->node)
+			continue;
+		/* directories are merged, like pkgentry_collides() does */
+		if (pes[i]->node->child ||
+		    (stat(pkgentry_path(pes[i], path), &sb) == 0 &&
+		     S_ISDIR(sb.st_mode)))
+			continue;
+		weprintf("%s is in more than one package\n",
+			 pkgentry_path(pes[i], path));
+		r = -1;
+	}
+	free(pes);
+	return r;
+}
+
+/* Install packages in dependency order.  A package is started once all
+ * the packages it depends on that are part of this batch are installed,
+ * running up to `jobs' installs at the same time.  Nothing new is
+ * started after an install failed */
+static int
+install_pkgs(struct db *db, struct pkg **pkgs, size_t n, long jobs)
+{
+	struct pkgdep *dep;
+	size_t *indeg, **rdeps, *nrdeps, ndone = 0, i, j, k;
+	pid_t *pids, pid;
+	long running = 0;
+	int status, failed = 0;
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < i; j++) {
+			if (strcmp(pkgs[i]->name, pkgs[j]->name) == 0) {
+				weprintf("%s: %s is already given\n",
+					 pkgs[i]->path, pkgs[i]->name);
+				return -1;
+			}
+		}
+	}
+	if (n > 1 && fflag == 0 && batch_collisions(pkgs, n) < 0)
+		return -1;
+
+	indeg = ecalloc(n, sizeof(*indeg));
+	nrdeps = ecalloc(n, sizeof(*nrdeps));
+	rdeps = ecalloc(n, sizeof(*rdeps));
+	pids = ecalloc(n, sizeof(*pids));
+	for (i = 0; i < n; i++) {
+		TAILQ_FOREACH(dep, &pkgs[i]->dep_head, entry) {
+			for (j = 0; j < n; j++)
+				if (strcmp(pkgs[j]->name, dep->name) == 0)
+					break;
+			if (j == n) {
+				if (!db_find(db, dep->name))
+					weprintf("%s: depends on %s which is not installed\n",
+						 pkgs[i]->name, dep->name);
+				continue;
+			}
+			if (j == i)
+				continue;
+			rdeps[j] = erealloc(rdeps[j], (nrdeps[j] + 1) * sizeof(**rdeps));
+			rdeps[j][nrdeps[j]++] = i;
+			indeg[i]++;
+		}
+	}
+
+	/* pids[i] is 0 while waiting, -1 once done and the worker otherwise */
+	while (ndone < n) {
+		for (i = 0; !failed && running < jobs && i < n; i++) {
+			if (indeg[i] > 0 || pids[i] != 0)
+				continue;
+			if (jobs == 1) {
+				if (install_pkg(db, pkgs[i]) < 0)
+					failed = 1;
+			} else {
+				fflush(NULL);
+				if ((pid = fork()) < 0) {
+					weprintf("fork:");
+					failed = 1;
+					break;
+				}
+				if (pid == 0) {
+					status = install_pkg(db, pkgs[i]);
+					fflush(NULL);
+					_exit(status < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+				}
+				pids[i] = pid;
+				running++;
+				continue;
+			}
+			/* installed in-process, release its dependents */
+			pids[i] = -1;
+			ndone++;
+			for (k = 0; k < nrdeps[i]; k++)
+				indeg[rdeps[i][k]]--;
+			i = -1;
+		}
+		if (running == 0) {
+			if (!failed && ndone < n) {
+				for (i = 0; i < n; i++)
+					if (pids[i] == 0)
+						weprintf("%s: circular dependency\n",
+							 pkgs[i]->name);
+				failed = 1;
+			}
+			break;
+		}
+		/* the counters are shared, so the jobs are reported here */
+		bucket_interrupt(1);
+		bucket_poll();
+		pid = wait(&status);
+		bucket_interrupt(0);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			weprintf("wait:");
+			failed = 1;
+			break;
+		}
+		for (i = 0; i < n; i++)
+			if (pids[i] == pid)
+				break;
+		if (i == n)
+			continue;
+		running--;
+		pids[i] = -1;
+		ndone++;
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+			failed = 1;
+			continue;
+		}
+		for (k = 0; k < nrdeps[i]; k++)
+			indeg[rdeps[i][k]]--;
+	}
+
+	for (i = 0; i < n; i++)
+		free(rdeps[i]);
+	free(rdeps);
+	free(nrdeps);
+	free(indeg);
+	free(pids);
+	return failed ? -1 : 0;
+}
+
+/* Install a package from a stream, without a copy of it on disk */
+static int
+install_fd(struct db *db, const char *file, int fd)
+{
+	struct pkg *pkg, *installed, *old;
+	char name[PATH_MAX];
+	const char *version;
+	size_t len;
+	int r;
+
+	len = parse_db_entry(file, &version);
+	if (len == 0 || len >= sizeof(name) || (version && version[0] == '\0'))
+		eprintf("%s: invalid package name\n", file);
+	memcpy(name, file, len);
+	name[len] = '\0';
+	pkg = pkg_new(file, name, version);
+
+	if (vflag == 1)
+		printf("installing %s\n", pkg->path);
+	installed = db_find(db, pkg->name);
+	old = uflag ? installed : NULL;
+	r = pkg_install_fd(db, pkg, old, fd);
+	/* record whatever made it to disk so it can be removed again,
+	 * unless that would clobber the entry of an installed package */
+	if ((r == 0 || !installed) && !TAILQ_EMPTY(&pkg->pe_head) &&
+	    db_add(db, pkg) < 0)
+		r = -1;
+	if (r == 0 && old && pkg_replace(db, old, pkg) < 0)
+		r = -1;
+	if (r < 0)
+		printf("not installed %s\n", pkg->path);
+	else
+		printf("installed %s\n", pkg->path);
+	pkg_free(pkg);
+	return r;
 }
@@ -0,0 +1,159 @@
+/* See LICENSE file for copyright and license details. */
+#include "pkg.h"
+
+static void
+usage(void)
+{
+	fprintf(stderr, VERSION " (c) 2014 morpheus engineers\n");
+	fprintf(stderr, "usage: %s [-v] [-u] [-r path]\n", argv0);
+	fprintf(stderr, "  -v    Enable verbose output\n");
+	fprintf(stderr, "  -u    Move the db entries back into a single directory\n");
+	fprintf(stderr, "  -r    Set alternative installation root\n");
+	exit(EXIT_FAILURE);
+}
+
+/* Write the path of the db entry `file' in the given layout to `buf' */
+static char *
+layout_path(struct db *db, const char *file, int sharded, char *buf)
+{
+	int cur = db->sharded;
+
+	db->sharded = sharded;
+	db_entrypath(db, file, buf);
+	db->sharded = cur;
+	return buf;
+}
+
+/* Hard link every entry of the current layout into the other one, so
+ * the db is complete in both layouts before switching over */
+static int
+link_entries(struct db *db, int to)
+{
+	struct dirent *dp;
+	char **files = NULL, src[PATH_MAX], dst[PATH_MAX];
+	size_t nfiles = 0, i;
+	int r = 0;
+
+	/* the new layout is created next to the old one, so list the
+	 * entries before adding anything */
+	db_rewind(db);
+	while ((dp = db_next(db))) {
+		files = erealloc(files, (nfiles + 1) * sizeof(*files));
+		files[nfiles++] = estrdup(dp->d_name);
+	}
+
+	for (i = 0; i < nfiles && r == 0; i++) {
+		layout_path(db, files[i], db->sharded, src);
+		if (to) {
+			db_shardpath(db, db_shard(files[i]), dst);
+			if (mkdir(dst, 0755) < 0 && errno != EEXIST) {
+				weprintf("mkdir %s:", dst);
+				r = -1;
+				continue;
+			}
+		}
+		layout_path(db, files[i], to, dst);
+		if (vflag == 1)
+			printf("linking %s to %s\n", src, dst);
+		r = link(src, dst);
+		if (r < 0 && errno == EEXIST) {
+			/* left over from an interrupted earlier run */
+			unlink(dst);
+			r = link(src, dst);
+		}
+		if (r < 0)
+			weprintf("link %s %s:", src, dst);
+	}
+
+	for (i = 0; i < nfiles; i++)
+		free(files[i]);
+	free(files);
+	return r;
+}
+
+/* Remove the entries of the layout that was switched away from, once
+ * they are known to be in place in the new one */
+static void
+unlink_entries(struct db *db, int to)
+{
+	struct dirent *dp;
+	struct stat sb;
+	char path[PATH_MAX], old[PATH_MAX];
+	unsigned i;
+
+	db->sharded = !to;
+	db_rewind(db);
+	while ((dp = db_next(db))) {
+		if (stat(layout_path(db, dp->d_name, to, path), &sb) < 0)
+			continue;
+		layout_path(db, dp->d_name, !to, old);
+		if (vflag == 1)
+			printf("removing %s\n", old);
+		if (unlink(old) < 0)
+			weprintf("unlink %s:", old);
+	}
+	db_rewind(db);
+	if (!to)
+		for (i = 0; i < DBSHARDS; i++)
+			rmdir(db_shardpath(db, i, path));
+	db->sharded = to;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct db *db;
+	char marker[PATH_MAX];
+	char *root = "/";
+	int uflag = 0, to, fd;
+
+	ARGBEGIN {
+	case 'v':
+		vflag = 1;
+		break;
+	case 'u':
+		uflag = 1;
+		break;
+	case 'r':
+		root = ARGF();
+		break;
+	default:
+		usage();
+	} ARGEND;
+
+	if (argc > 0)
+		usage();
+
+	db = db_new(root);
+	if (!db)
+		exit(EXIT_FAILURE);
+	estrlcpy(marker, db->path, sizeof(marker));
+	estrlcat(marker, "/" DBSHARDED, sizeof(marker));
+
+	to = !uflag;
+	if (db->sharded != to) {
+		if (link_entries(db, to) < 0) {
+			db_free(db);
+			exit(EXIT_FAILURE);
+		}
+		sync();
+		/* the layout is decided by the marker alone, so this is
+		 * where the db switches over */
+		if (to) {
+			if ((fd = open(marker, O_WRONLY | O_CREAT, 0644)) < 0)
+				eprintf("open %s:", marker);
+			close(fd);
+		} else if (unlink(marker) < 0) {
+			eprintf("unlink %s:", marker);
+		}
+		sync();
+	}
+	/* also finishes the cleanup of an interrupted earlier run */
+	unlink_entries(db, to);
+	sync();
+
+	printf("%s is %s\n", db->path, to ? "sharded" : "not sharded");
+	db_free(db);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,271 @@
+/* See LICENSE file for copyright and license details. */
+#include "pkg.h"
+
+struct file {
+	char *rpath;			/* relative path of the file */
+	struct archive_entry *entry;	/* for the metadata of the file */
+	void *data;
+	size_t size;
+};
+
+struct member {
+	struct archive_entry *entry;
+	void *data;
+	size_t size;
+};
+
+static void
+usage(void)
+{
+	fprintf(stderr, VERSION " (c) 2014 morpheus engineers\n");
+	fprintf(stderr, "usage: %s [-v] [-o file] old new\n", argv0);
+	fprintf(stderr, "  -v    Enable verbose output\n");
+	fprintf(stderr, "  -o    Write the delta package to file\n");
+	exit(EXIT_FAILURE);
+}
+
+static int
+cmpfile(const void *a, const void *b)
+{
+	return strcmp(((const struct file *)a)->rpath,
+		      ((const struct file *)b)->rpath);
+}
+
+static struct archive *
+open_pkg(const char *path)
+{
+	struct archive *ar;
+
+	ar = pkg_archive_new();
+	if (pkg_archive_open(ar, path) < 0)
+		eprintf("archive_read_open %s: %s\n", path,
+			archive_error_string(ar));
+	return ar;
+}
+
+static const char *
+entry_rpath(struct archive_entry *entry)
+{
+	const char *p = archive_entry_pathname(entry);
+
+	if (strncmp(p, "./", 2) == 0)
+		p += 2;
+	return p;
+}
+
+static int
+isreg(struct archive_entry *entry)
+{
+	return archive_entry_filetype(entry) == AE_IFREG &&
+	       !archive_entry_hardlink(entry);
+}
+
+/* Check if installing `b' over `a' leaves the metadata installpkg
+ * applies unchanged */
+static int
+samemeta(struct archive_entry *a, struct archive_entry *b)
+{
+	return archive_entry_perm(a) == archive_entry_perm(b) &&
+	       archive_entry_uid(a) == archive_entry_uid(b) &&
+	       archive_entry_gid(a) == archive_entry_gid(b) &&
+	       archive_entry_mtime(a) == archive_entry_mtime(b) &&
+	       archive_entry_mtime_nsec(a) == archive_entry_mtime_nsec(b);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct archive *ar, *aw;
+	struct archive_entry *entry;
+	struct file *files = NULL, key, *f;
+	struct member *members = NULL, *m;
+	char out[PATH_MAX], basesum[SHA256_HEX_LENGTH], newsum[SHA256_HEX_LENGTH];
+	char *name, *newname, *base, *version, *meta = NULL, *o = NULL;
+	char *rpath, *p;
+	void *data, *patch;
+	size_t nfiles = 0, nmembers = 0, i, sz, psz, metasz;
+	FILE *fp;
+	int r;
+
+	ARGBEGIN {
+	case 'v':
+		vflag = 1;
+		break;
+	case 'o':
+		o = EARGF(usage());
+		break;
+	default:
+		usage();
+	} ARGEND;
+
+	if (argc != 2)
+		usage();
+
+	parse_name(argv[0], &name);
+	parse_name(argv[1], &newname);
+	if (strcmp(name, newname) != 0)
+		eprintf("%s and %s are different packages\n", argv[0], argv[1]);
+	parse_version(argv[0], &base);
+	parse_version(argv[1], &version);
+
+	/* keep the regular files of the old version around for diffing */
+	ar = open_pkg(argv[0]);
+	while ((r = archive_read_next_header(ar, &entry)) == ARCHIVE_OK) {
+		if (!isreg(entry))
+			continue;
+		files = erealloc(files, (nfiles + 1) * sizeof(*files));
+		f = &files[nfiles++];
+		f->rpath = estrdup(entry_rpath(entry));
+		f->entry = archive_entry_clone(entry);
+		if (!(f->data = readentry(ar, entry, &f->size)))
+			exit(EXIT_FAILURE);
+	}
+	if (r != ARCHIVE_EOF)
+		eprintf("archive_read_next_header %s: %s\n", argv[0],
+			archive_error_string(ar));
+	archive_read_free(ar);
+	qsort(files, nfiles, sizeof(*files), cmpfile);
+
+	if (!(fp = open_memstream(&meta, &metasz)))
+		eprintf("open_memstream:");
+	fprintf(fp, "name %s\n", name);
+	if (base)
+		fprintf(fp, "base %s\n", base);
+	if (version)
+		fprintf(fp, "version %s\n", version);
+
+	ar = open_pkg(argv[1]);
+	while ((r = archive_read_next_header(ar, &entry)) == ARCHIVE_OK) {
+		/* dependencies go into the metadata */
+		if (strcmp(entry_rpath(entry), PKGDEPENDS) == 0) {
+			if (!(data = readentry(ar, entry, &sz)))
+				exit(EXIT_FAILURE);
+			for (p = strtok(data, "\n"); p; p = strtok(NULL, "\n")) {
+				p += strspn(p, " \t");
+				p[strcspn(p, " \t")] = '\0';
+				if (p[0] != '\0' && p[0] != '#')
+					fprintf(fp, "depends %s\n", p);
+			}
+			free(data);
+			continue;
+		}
+		rpath = estrdup(entry_rpath(entry));
+		if (rpath[0] != '\0')
+			fprintf(fp, "entry %s\n", rpath);
+		data = NULL;
+		sz = 0;
+		f = NULL;
+		if (isreg(entry)) {
+			if (!(data = readentry(ar, entry, &sz)))
+				exit(EXIT_FAILURE);
+			key.rpath = rpath;
+			f = bsearch(&key, files, nfiles, sizeof(*files), cmpfile);
+			/* a file with new metadata is shipped even if its
+			 * content is unchanged, likely as a tiny patch */
+			if (f && f->size == sz && memcmp(f->data, data, sz) == 0 &&
+			    samemeta(f->entry, entry)) {
+				free(data);
+				free(rpath);
+				continue;
+			}
+			if (f) {
+				patch = diff_make(f->data, f->size, data, sz, &psz);
+				/* only ship a patch when it's worth it */
+				if (psz < sz - sz / 4) {
+					sha256_hex(f->data, f->size, basesum);
+					sha256_hex(data, sz, newsum);
+					fprintf(fp, "patch %s %s %s\n", basesum,
+						newsum, rpath);
+					if (vflag == 1)
+						printf("patch %s (%zu -> %zu bytes)\n",
+						       rpath, sz, psz);
+					free(data);
+					data = patch;
+					sz = psz;
+				} else {
+					free(patch);
+					f = NULL;
+				}
+			}
+			if (!f && vflag == 1)
+				printf("file %s\n", rpath);
+		}
+		members = erealloc(members, (nmembers + 1) * sizeof(*members));
+		m = &members[nmembers++];
+		m->entry = archive_entry_clone(entry);
+		m->data = data;
+		m->size = sz;
+		if (f) {
+			estrlcpy(out, DELTAPATCH, sizeof(out));
+			estrlcat(out, rpath, sizeof(out));
+			archive_entry_set_pathname(m->entry, out);
+			archive_entry_set_size(m->entry, sz);
+		}
+		free(rpath);
+	}
+	if (r != ARCHIVE_EOF)
+		eprintf("archive_read_next_header %s: %s\n", argv[1],
+			archive_error_string(ar));
+	archive_read_free(ar);
+	if (fclose(fp) == EOF)
+		eprintf("write:");
+
+	if (o) {
+		estrlcpy(out, o, sizeof(out));
+	} else {
+		estrlcpy(out, name, sizeof(out));
+		if (version) {
+			estrlcat(out, "#", sizeof(out));
+			estrlcat(out, version, sizeof(out));
+		}
+		estrlcat(out, ".pkg.dtgz", sizeof(out));
+	}
+
+	aw = archive_write_new();
+	archive_write_add_filter_gzip(aw);
+	archive_write_set_format_pax_restricted(aw);
+	if (archive_write_open_filename(aw, out) < 0)
+		eprintf("archive_write_open_filename %s: %s\n", out,
+			archive_error_string(aw));
+
+	/* the metadata always comes first so it can be checked up front */
+	entry = archive_entry_new();
+	archive_entry_set_pathname(entry, DELTAMETA);
+	archive_entry_set_filetype(entry, AE_IFREG);
+	archive_entry_set_perm(entry, 0644);
+	archive_entry_set_size(entry, metasz);
+	if (archive_write_header(aw, entry) < 0 ||
+	    archive_write_data(aw, meta, metasz) < 0)
+		eprintf("archive_write %s: %s\n", out, archive_error_string(aw));
+	archive_entry_free(entry);
+
+	for (i = 0; i < nmembers; i++) {
+		m = &members[i];
+		if (archive_write_header(aw, m->entry) < 0 ||
+		    (m->size > 0 && archive_write_data(aw, m->data, m->size) < 0))
+			eprintf("archive_write %s: %s\n", out,
+				archive_error_string(aw));
+		archive_entry_free(m->entry);
+		free(m->data);
+	}
+	if (archive_write_close(aw) < 0)
+		eprintf("archive_write_close %s: %s\n", out,
+			archive_error_string(aw));
+	archive_write_free(aw);
+
+	for (i = 0; i < nfiles; i++) {
+		free(files[i].rpath);
+		archive_entry_free(files[i].entry);
+		free(files[i].data);
+	}
+	free(files);
+	free(members);
+	free(meta);
+	free(name);
+	free(newname);
+	free(base);
+	free(version);
+
+	puts(out);
+	return EXIT_SUCCESS;
+}
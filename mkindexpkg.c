@@ -0,0 +1,281 @@
+/* See LICENSE file for copyright and license details. */
+#include "pkg.h"
+
+/* A package archive of the mirror and what was read from it */
+struct scan {
+	char *file;			/* filename in the mirror directory */
+	struct pkg *pkg;
+	uint64_t size;
+	uint8_t sha256[SHA256_DIGEST_LENGTH];
+	char **paths;
+	size_t npaths;
+	int failed;
+};
+
+static const char *dir = ".";
+static struct scan *scans;
+static size_t nscans;
+static size_t next;			/* next archive to scan */
+static pthread_mutex_t nextlock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+usage(void)
+{
+	fprintf(stderr, VERSION " (c) 2014 morpheus engineers\n");
+	fprintf(stderr, "usage: %s [-v] [-j jobs] [dir]\n", argv0);
+	fprintf(stderr, "  -v    Enable verbose output\n");
+	fprintf(stderr, "  -j    Read up to jobs package archives in parallel\n");
+	exit(EXIT_FAILURE);
+}
+
+static int
+ispkg(const char *name)
+{
+	const char *ext[] = { ".pkg.tgz", ".pkg.tzst" };
+	size_t len = strlen(name), i;
+
+	if (name[0] == '.')
+		return 0;
+	for (i = 0; i < LEN(ext); i++)
+		if (len > strlen(ext[i]) &&
+		    strcmp(name + len - strlen(ext[i]), ext[i]) == 0)
+			return 1;
+	return 0;
+}
+
+static int
+cmpscan(const void *a, const void *b)
+{
+	return strcmp(((const struct scan *)a)->file,
+		      ((const struct scan *)b)->file);
+}
+
+/* Read the checksum, dependencies and file list of a package archive */
+static int
+scan_pkg(struct scan *sc)
+{
+	struct archive *ar;
+	struct archive_entry *entry;
+	char path[PATH_MAX], *name, *version, *deps;
+	const char *tmp;
+	size_t sz;
+	int r;
+
+	estrlcpy(path, dir, sizeof(path));
+	estrlcat(path, "/", sizeof(path));
+	estrlcat(path, sc->file, sizeof(path));
+	if (sha256_digest(path, sc->sha256, &sc->size) < 0) {
+		weprintf("read %s:", path);
+		return -1;
+	}
+	parse_name(path, &name);
+	parse_version(path, &version);
+	sc->pkg = pkg_new(path, name, version);
+	free(name);
+	free(version);
+
+	ar = pkg_archive_new();
+	if (pkg_archive_open(ar, path) < 0) {
+		weprintf("archive_read_open %s: %s\n", path,
+			 archive_error_string(ar));
+		archive_read_free(ar);
+		return -1;
+	}
+	while ((r = archive_read_next_header(ar, &entry)) == ARCHIVE_OK) {
+		tmp = archive_entry_pathname(entry);
+		if (strncmp(tmp, "./", 2) == 0)
+			tmp += 2;
+		if (tmp[0] == '\0')
+			continue;
+		if (strcmp(tmp, PKGDEPENDS) == 0) {
+			if (!(deps = readentry(ar, entry, &sz))) {
+				archive_read_free(ar);
+				return -1;
+			}
+			pkg_add_depends(sc->pkg, deps);
+			free(deps);
+			continue;
+		}
+		sc->paths = erealloc(sc->paths,
+				     (sc->npaths + 1) * sizeof(*sc->paths));
+		sc->paths[sc->npaths++] = estrdup(tmp);
+	}
+	if (r != ARCHIVE_EOF) {
+		weprintf("archive_read_next_header %s: %s\n", path,
+			 archive_error_string(ar));
+		archive_read_free(ar);
+		return -1;
+	}
+	archive_read_free(ar);
+	if (vflag == 1)
+		printf("scanned %s\n", path);
+	return 0;
+}
+
+static void *
+scan_run(void *arg)
+{
+	size_t i;
+
+	(void) arg;
+
+	for (;;) {
+		pthread_mutex_lock(&nextlock);
+		i = next++;
+		pthread_mutex_unlock(&nextlock);
+		if (i >= nscans)
+			break;
+		scans[i].failed = scan_pkg(&scans[i]) < 0;
+	}
+	return NULL;
+}
+
+/* Write `tmp' with `save' and rename it over `path' in the mirror */
+static int
+publish(const char *path, const char *tmp, int (*save)(const char *, void *),
+	void *data)
+{
+	if (save(tmp, data) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	if (rename(tmp, path) < 0) {
+		weprintf("rename %s %s:", tmp, path);
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+save_index(const char *path, void *data)
+{
+	struct catalog cat;
+
+	if (cat_save(data, path) < 0)
+		return -1;
+	/* never publish an index clients cannot read */
+	if (cat_open(&cat, path) < 0)
+		return -1;
+	cat_close(&cat);
+	return 0;
+}
+
+static int
+save_list(const char *path, void *data)
+{
+	FILE *fp;
+	size_t i;
+
+	(void) data;
+
+	if (!(fp = fopen(path, "w"))) {
+		weprintf("fopen %s:", path);
+		return -1;
+	}
+	for (i = 0; i < nscans; i++)
+		fprintf(fp, "%s\n", scans[i].file);
+	if (ferror(fp) | (fclose(fp) == EOF)) {
+		weprintf("write %s:", path);
+		return -1;
+	}
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct catbuild b;
+	pthread_t *threads;
+	DIR *dp;
+	struct dirent *de;
+	char path[PATH_MAX], tmp[PATH_MAX];
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN), i;
+	size_t j, k;
+	int r = 0;
+
+	ARGBEGIN {
+	case 'v':
+		vflag = 1;
+		break;
+	case 'j':
+		jobs = estrtol(EARGF(usage()), 10);
+		if (jobs < 1)
+			usage();
+		break;
+	default:
+		usage();
+	} ARGEND;
+
+	if (argc > 1)
+		usage();
+	if (argc == 1)
+		dir = argv[0];
+	if (jobs < 1)
+		jobs = 1;
+
+	if (!(dp = opendir(dir)))
+		eprintf("opendir %s:", dir);
+	while ((de = readdir(dp))) {
+		if (!ispkg(de->d_name))
+			continue;
+		scans = erealloc(scans, (nscans + 1) * sizeof(*scans));
+		memset(&scans[nscans], 0, sizeof(*scans));
+		scans[nscans++].file = estrdup(de->d_name);
+	}
+	closedir(dp);
+	if (nscans > 0)
+		qsort(scans, nscans, sizeof(*scans), cmpscan);
+
+	/* the archives are scanned in parallel and added in order, so the
+	 * catalog only depends on the contents of the mirror */
+	if ((size_t)jobs > nscans)
+		jobs = MAX(nscans, 1);
+	threads = emalloc(jobs * sizeof(*threads));
+	for (i = 0; i < jobs; i++)
+		if ((errno = pthread_create(&threads[i], NULL, scan_run, NULL)) != 0)
+			eprintf("pthread_create:");
+	for (i = 0; i < jobs; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	cat_init(&b);
+	for (j = 0; j < nscans; j++) {
+		if (scans[j].failed) {
+			r = -1;
+			continue;
+		}
+		cat_add(&b, scans[j].pkg, scans[j].file, scans[j].size,
+			scans[j].sha256, scans[j].paths, scans[j].npaths);
+	}
+
+	/* a partial index would hide packages, keep the old one */
+	if (r == 0) {
+		estrlcpy(path, dir, sizeof(path));
+		estrlcat(path, "/" MIRRORINDEX, sizeof(path));
+		estrlcpy(tmp, dir, sizeof(tmp));
+		estrlcat(tmp, "/." MIRRORINDEX ".tmp", sizeof(tmp));
+		r = publish(path, tmp, save_index, &b);
+	}
+	if (r == 0) {
+		estrlcpy(path, dir, sizeof(path));
+		estrlcat(path, "/" MIRRORLIST, sizeof(path));
+		estrlcpy(tmp, dir, sizeof(tmp));
+		estrlcat(tmp, "/." MIRRORLIST ".tmp", sizeof(tmp));
+		r = publish(path, tmp, save_list, NULL);
+	}
+	if (r == 0 && vflag == 1)
+		printf("indexed %zu packages, %zu files\n", b.npkgs, b.nfiles);
+
+	cat_free(&b);
+	for (j = 0; j < nscans; j++) {
+		for (k = 0; k < scans[j].npaths; k++)
+			free(scans[j].paths[k]);
+		free(scans[j].paths);
+		if (scans[j].pkg)
+			pkg_free(scans[j].pkg);
+		free(scans[j].file);
+	}
+	free(scans);
+	return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
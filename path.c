@@ -0,0 +1,311 @@
+/* See LICENSE file for copyright and license details. */
+#include "pkg.h"
+
+/*
+ * Paths of the db are kept as a trie of interned components shared by
+ * all packages.  Nodes are found by hashing the parent node together
+ * with the component name, and are never freed before the db.  The top
+ * node stands for the db root and carries it as its name.
+ */
+
+static size_t
+path_hash(const struct pathnode *parent, const char *name, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL ^ (uintptr_t)parent;
+
+	while (len--)
+		h = (h ^ (unsigned char)*name++) * 0x100000001b3ULL;
+	/* the table is indexed by the low bits, fold the high ones in */
+	return h ^ (h >> 32);
+}
+
+/* The table is open addressed and kept at most half full.  Slots carry
+ * the hash so probing rarely has to touch the nodes themselves */
+static void
+path_grow(struct db *db)
+{
+	struct pathslot *old = db->ptab;
+	size_t oldsz = db->ptabsz, i, h;
+
+	db->ptabsz = oldsz ? oldsz * 2 : 4096;
+	db->ptab = ecalloc(db->ptabsz, sizeof(*db->ptab));
+	for (i = 0; i < oldsz; i++) {
+		if (!old[i].node)
+			continue;
+		for (h = old[i].hash & (db->ptabsz - 1); db->ptab[h].node;
+		     h = (h + 1) & (db->ptabsz - 1))
+			;
+		db->ptab[h] = old[i];
+	}
+	free(old);
+}
+
+static struct pathnode *
+path_top(struct db *db)
+{
+	if (!db->top) {
+		db->top = arena_alloc(&db->arena, sizeof(*db->top) +
+				      strlen(db->root) + 1);
+		memset(db->top, 0, sizeof(*db->top));
+		strcpy(db->top->name, db->root);
+	}
+	return db->top;
+}
+
+/* Find the child `name' of `parent', creating it if `create' is set */
+static struct pathnode *
+path_child(struct db *db, struct pathnode *parent, const char *name,
+	   size_t len, int create)
+{
+	struct pathnode *n;
+	size_t hash = path_hash(parent, name, len), h = 0;
+
+	if (db->ptabsz) {
+		for (h = hash & (db->ptabsz - 1); (n = db->ptab[h].node);
+		     h = (h + 1) & (db->ptabsz - 1))
+			if (db->ptab[h].hash == hash && n->parent == parent &&
+			    strncmp(n->name, name, len) == 0 && n->name[len] == '\0')
+				return n;
+	}
+	if (!create)
+		return NULL;
+
+	if (2 * (db->npaths + 1) > db->ptabsz) {
+		path_grow(db);
+		for (h = hash & (db->ptabsz - 1); db->ptab[h].node;
+		     h = (h + 1) & (db->ptabsz - 1))
+			;
+	}
+	n = arena_alloc(&db->arena, sizeof(*n) + len + 1);
+	memset(n, 0, sizeof(*n));
+	memcpy(n->name, name, len);
+	n->name[len] = '\0';
+	n->parent = parent;
+	n->sibling = parent->child;
+	parent->child = n;
+	db->ptab[h].hash = hash;
+	db->ptab[h].node = n;
+	db->npaths++;
+	return n;
+}
+
+/* Count the components of a path the same way path_walk() does */
+static size_t
+path_depth(const char *p, size_t len)
+{
+	const char *q;
+	size_t n = 0, l;
+
+	while (len > 0) {
+		q = memchr(p, '/', len);
+		l = q ? (size_t)(q - p) : len;
+		if (l > 0 && !(l == 1 && p[0] == '.'))
+			n++;
+		p += l;
+		len -= l;
+		while (len > 0 && *p == '/') {
+			p++;
+			len--;
+		}
+	}
+	return n;
+}
+
+/* Paths are given with their length as they are parsed in place from
+ * the db files, and need not be NUL terminated */
+static struct pathnode *
+path_walk(struct db *db, const char *rpath, size_t len, int create)
+{
+	struct pathnode *n = path_top(db);
+	const char *end, *base, *q;
+	size_t l, dirlen, common, up;
+
+	while (len > 0 && *rpath == '/') {
+		rpath++;
+		len--;
+	}
+	while (len > 0 && rpath[len - 1] == '/')
+		len--;
+	end = rpath + len;
+	for (base = end; base > rpath && base[-1] != '/'; base--)
+		;
+	dirlen = base - rpath;
+
+	/* manifests list the files of a directory next to each other, so
+	 * start from the deepest directory shared with the last lookup */
+	if (db->lastdir && dirlen > 0) {
+		for (common = 0; common < dirlen && common < db->lastdirlen &&
+		     rpath[common] == db->lastdirpath[common]; common++)
+			;
+		while (common > 0 && rpath[common - 1] != '/')
+			common--;
+		if (common > 0) {
+			up = path_depth(db->lastdirpath + common,
+					db->lastdirlen - common);
+			for (n = db->lastdir; up > 0; up--)
+				n = n->parent;
+			rpath += common;
+		}
+	}
+
+	while (n && rpath < end) {
+		q = memchr(rpath, '/', end - rpath);
+		l = q ? (size_t)(q - rpath) : (size_t)(end - rpath);
+		if (l > 0 && !(l == 1 && rpath[0] == '.'))
+			n = path_child(db, n, rpath, l, create);
+		rpath += l;
+		while (rpath < end && *rpath == '/')
+			rpath++;
+		if (n && rpath == base && dirlen > 0 &&
+		    dirlen < sizeof(db->lastdirpath)) {
+			db->lastdir = n;
+			db->lastdirlen = dirlen;
+			memcpy(db->lastdirpath, base - dirlen, dirlen);
+		}
+	}
+	return n;
+}
+
+/* Return the child `name' of `parent', adding it if needed.  A NULL
+ * parent stands for the parent of the top node */
+struct pathnode *
+path_add(struct db *db, struct pathnode *parent, const char *name, size_t len)
+{
+	if (!parent)
+		return path_top(db);
+	return path_child(db, parent, name, len, 1);
+}
+
+/* Make room for `n' nodes up front when their number is known */
+void
+path_reserve(struct db *db, size_t n)
+{
+	while (2 * n > db->ptabsz)
+		path_grow(db);
+}
+
+/* Return the node of the first `len' bytes of a path relative to the
+ * db root, adding it if needed */
+struct pathnode *
+path_intern(struct db *db, const char *rpath, size_t len)
+{
+	return path_walk(db, rpath, len, 1);
+}
+
+/* Return the node of a path relative to the db root, or NULL */
+struct pathnode *
+path_lookup(struct db *db, const char *rpath)
+{
+	return path_walk(db, rpath, strlen(rpath), 0);
+}
+
+/* Write the path of `n' to `buf', relative to the db root unless `abs'
+ * is set.  Directories get a trailing slash if `dir' is set */
+char *
+path_build(const struct pathnode *n, int dir, int abs, char *buf)
+{
+	const struct pathnode *p;
+	size_t len = 0, rootlen = 0, off, l;
+
+	for (p = n; p->parent; p = p->parent)
+		len += strlen(p->name) + 1;
+	if (!n->parent) {
+		if (abs)
+			estrlcpy(buf, p->name, PATH_MAX);
+		else
+			buf[0] = '\0';
+		return buf;
+	}
+	if (abs) {
+		rootlen = strlen(p->name);
+		/* avoid a double slash for a db root of "/" */
+		if (rootlen == 1 && p->name[0] == '/')
+			rootlen = 0;
+	}
+	if (rootlen + len + (dir != 0) >= PATH_MAX)
+		eprintf("path too long\n");
+
+	/* fill in back to front, each component preceded by a slash */
+	off = rootlen + len;
+	if (dir)
+		buf[off++] = '/';
+	buf[off] = '\0';
+	off = rootlen + len;
+	for (p = n; p->parent; p = p->parent) {
+		l = strlen(p->name);
+		off -= l;
+		memcpy(buf + off, p->name, l);
+		buf[--off] = '/';
+	}
+	if (abs)
+		memcpy(buf, p->name, rootlen);
+	else
+		memmove(buf, buf + 1, len + (dir != 0));
+	return buf;
+}
+
+void
+path_own(struct db *db, struct pathnode *n, struct pkg *pkg)
+{
+	struct owner *o;
+
+	/* a package is owned in one go, so if it already owns `n' it was
+	 * the last one to be added */
+	if (n->owners && n->owners->pkg == pkg)
+		return;
+	o = arena_alloc(&db->arena, sizeof(*o));
+	o->pkg = pkg;
+	o->next = n->owners;
+	n->owners = o;
+}
+
+void
+path_disown(struct pathnode *n, struct pkg *pkg)
+{
+	struct owner **op;
+
+	for (op = &n->owners; *op; op = &(*op)->next) {
+		if ((*op)->pkg == pkg) {
+			*op = (*op)->next;
+			return;
+		}
+	}
+}
+
+/* Return the number of installed packages shipping `n' */
+int
+path_owners(const struct pathnode *n)
+{
+	const struct owner *o;
+	int i = 0;
+
+	for (o = n->owners; o; o = o->next)
+		i++;
+	return i;
+}
+
+/* Call `cb' for `n' and every node below it */
+int
+path_subtree(struct pathnode *n, int (*cb)(struct pathnode *, void *), void *data)
+{
+	struct pathnode *c;
+	int r;
+
+	if ((r = cb(n, data)) != 0)
+		return r;
+	for (c = n->child; c; c = c->sibling)
+		if ((r = path_subtree(c, cb, data)) != 0)
+			return r;
+	return 0;
+}
+
+void
+path_free(struct db *db)
+{
+	free(db->ptab);
+	db->ptab = NULL;
+	db->ptabsz = 0;
+	db->npaths = 0;
+	db->top = NULL;
+	db->lastdir = NULL;
+}
@@ -1,64 +1,110 @@
 /* See LICENSE file for copyright and license details. */
 #include "pkg.h"
 
-/* Create a package from the db entry.  e.g. /var/pkg/pkg#version */
+struct archive *
+pkg_archive_new(void)
+{
+	struct archive *ar;
+
+	ar = archive_read_new();
+
+	archive_read_support_filter_gzip(ar);
+	archive_read_support_filter_bzip2(ar);
+	archive_read_support_filter_xz(ar);
+	archive_read_support_filter_zstd(ar);
+	archive_read_support_format_tar(ar);
+
+	return ar;
+}
+
+/* Db entries smaller than this are read into the buffer of the db, for
+ * them setting up and tearing down a mapping costs more than the copy */
+#define MAPMIN (64 * 1024)
+
+/* Create a package from the db entry.  e.g. /var/pkg/pkg#version
+ * The package lives in the db arena and is released with the db.  The
+ * entry is read in one go and its lines are interned in place */
 struct pkg *
 pkg_load(struct db *db, const char *file)
 {
 	struct pkg *pkg;
 	struct pkgentry *pe;
-	FILE *fp;
-	char path[PATH_MAX];
-	char *name, *version;
-	char *buf = NULL;
-	size_t sz = 0;
-	ssize_t len;
-
-	parse_db_name(file, &name);
-	parse_db_version(file, &version);
-	estrlcpy(path, db->path, sizeof(path));
-	estrlcat(path, "/", sizeof(path));
-	estrlcat(path, name, sizeof(path));
-	if (version) {
-		estrlcat(path, "#", sizeof(path));
-		estrlcat(path, version, sizeof(path));
-	}
-	pkg = pkg_new(path, name, version);
-	free(name);
-	free(version);
+	struct stat sb;
+	char tmp[PATH_MAX], *map = NULL;
+	const char *version, *p, *end, *nl;
+	size_t len, size;
+	ssize_t n;
+	int fd;
 
-	if (!(fp = fopen(pkg->path, "r"))) {
-		weprintf("fopen %s:", pkg->path);
-		pkg_free(pkg);
+	len = parse_db_entry(file, &version);
+	pkg = arena_alloc(&db->arena, sizeof(*pkg));
+	pkg->name = arena_strndup(&db->arena, file, len);
+	pkg->version = version ? arena_strdup(&db->arena, version) : NULL;
+	pkg->arena = 1;
+	TAILQ_INIT(&pkg->pe_head);
+	TAILQ_INIT(&pkg->dep_head);
+	pkg->path = arena_strdup(&db->arena, db_entrypath(db, file, tmp));
+
+	if ((fd = open(pkg->path, O_RDONLY)) < 0) {
+		weprintf("open %s:", pkg->path);
 		return NULL;
 	}
+	if (fstat(fd, &sb) < 0) {
+		weprintf("fstat %s:", pkg->path);
+		close(fd);
+		return NULL;
+	}
+	size = sb.st_size;
+	if (size >= MAPMIN) {
+		map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			weprintf("mmap %s:", pkg->path);
+			close(fd);
+			return NULL;
+		}
+		p = map;
+	} else {
+		if (size > db->bufsz) {
+			db->buf = erealloc(db->buf, size);
+			db->bufsz = size;
+		}
+		for (len = 0; len < size; len += n) {
+			if ((n = read(fd, db->buf + len, size - len)) < 0) {
+				weprintf("%s: read error:", pkg->path);
+				close(fd);
+				return NULL;
+			}
+			if (n == 0)
+				break;
+		}
+		size = len;
+		p = db->buf;
+	}
+	close(fd);
 
-	while ((len = getline(&buf, &sz, fp)) != -1) {
-		if (len > 0 && buf[len - 1] == '\n')
-			buf[len - 1] = '\0';
-
-		if (buf[0] == '\0') {
+	for (end = p + size; p < end; p = nl + 1) {
+		if (!(nl = memchr(p, '\n', end - p)))
+			nl = end;
+		len = nl - p;
+		if (len == 0) {
 			weprintf("%s: malformed pkg file\n", pkg->path);
-			free(buf);
-			fclose(fp);
-			pkg_free(pkg);
-			return NULL;
+			pkg = NULL;
+			break;
+		}
+		if (len >= PATH_MAX) {
+			weprintf("%.*s: path too long\n", (int)len, p);
+			pkg = NULL;
+			break;
 		}
 
-		pe = pkgentry_new(db, buf);
+		pe = arena_alloc(&db->arena, sizeof(*pe));
+		pe->node = path_intern(db, p, len);
+		pe->dir = p[len - 1] == '/';
 		TAILQ_INSERT_TAIL(&pkg->pe_head, pe, entry);
 	}
 
-	if (ferror(fp)) {
-		weprintf("%s: read error:", pkg->name);
-		free(buf);
-		fclose(fp);
-		pkg_free(pkg);
-		return NULL;
-	}
-
-	free(buf);
-	fclose(fp);
+	if (map)
+		munmap(map, sb.st_size);
 
 	return pkg;
 }
@@ -73,7 +119,8 @@ pkg_load_file(struct db *db, const char *file)
 	struct archive_entry *entry;
 	char path[PATH_MAX];
 	const char *tmp;
-	char *name, *version;
+	char *name, *version, *deps;
+	size_t sz;
 	int r;
 
 	if (!realpath(file, path)) {
@@ -87,15 +134,10 @@ pkg_load_file(struct db *db, const char *file)
 	free(name);
 	free(version);
 
-	ar = archive_read_new();
-
-	archive_read_support_filter_gzip(ar);
-	archive_read_support_filter_bzip2(ar);
-	archive_read_support_filter_xz(ar);
-	archive_read_support_format_tar(ar);
+	ar = pkg_archive_new();
 
-	if (archive_read_open_filename(ar, pkg->path, ARCHIVEBUFSIZ) < 0) {
-		weprintf("archive_read_open_filename %s: %s\n", pkg->path,
+	if (pkg_archive_open(ar, pkg->path) < 0) {
+		weprintf("archive_read_open %s: %s\n", pkg->path,
 			 archive_error_string(ar));
 		archive_read_free(ar);
 		pkg_free(pkg);
@@ -121,6 +163,17 @@ pkg_load_file(struct db *db, const char *file)
 		if (tmp[0] == '\0')
 			continue;
 
+		if (strcmp(tmp, PKGDEPENDS) == 0) {
+			if (!(deps = readentry(ar, entry, &sz))) {
+				archive_read_free(ar);
+				pkg_free(pkg);
+				return NULL;
+			}
+			pkg_add_depends(pkg, deps);
+			free(deps);
+			continue;
+		}
+
 		pe = pkgentry_new(db, tmp);
 		TAILQ_INSERT_TAIL(&pkg->pe_head, pe, entry);
 	}
@@ -130,75 +183,761 @@ pkg_load_file(struct db *db, const char *file)
 	return pkg;
 }
 
-int
-pkg_install(struct db *db, struct pkg *pkg)
+static int
+cmpnode(const void *a, const void *b)
 {
-	struct archive *ar;
-	struct archive_entry *entry;
-	char cwd[PATH_MAX];
-	int flags, r;
+	uintptr_t x = (uintptr_t)*(struct pathnode *const *)a;
+	uintptr_t y = (uintptr_t)*(struct pathnode *const *)b;
 
-	ar = archive_read_new();
+	return x < y ? -1 : x > y;
+}
 
-	archive_read_support_filter_gzip(ar);
-	archive_read_support_filter_bzip2(ar);
-	archive_read_support_filter_xz(ar);
-	archive_read_support_format_tar(ar);
+/* Return the sorted path nodes of the package entries */
+static struct pathnode **
+pkg_nodes(struct pkg *pkg, size_t *n)
+{
+	struct pkgentry *pe;
+	struct pathnode **set;
+
+	*n = 0;
+	TAILQ_FOREACH(pe, &pkg->pe_head, entry)
+		(*n)++;
+	set = emalloc((*n + 1) * sizeof(*set));
+	*n = 0;
+	TAILQ_FOREACH(pe, &pkg->pe_head, entry)
+		set[(*n)++] = pe->node;
+	qsort(set, *n, sizeof(*set), cmpnode);
+	return set;
+}
+
+static int
+inset(struct pathnode **set, size_t n, struct pathnode *node)
+{
+	return set && node &&
+	       bsearch(&node, set, n, sizeof(*set), cmpnode) != NULL;
+}
+
+/* Apply the ownership, permissions and times of an archive entry */
+void
+fsetmeta(int fd, struct archive_entry *entry, const char *path)
+{
+	struct timespec ts[2];
+
+	if (geteuid() == 0 &&
+	    fchown(fd, archive_entry_uid(entry), archive_entry_gid(entry)) < 0)
+		weprintf("fchown %s:", path);
+	if (fchmod(fd, archive_entry_perm(entry)) < 0)
+		weprintf("fchmod %s:", path);
+	ts[0].tv_sec = ts[1].tv_sec = archive_entry_mtime(entry);
+	ts[0].tv_nsec = ts[1].tv_nsec = archive_entry_mtime_nsec(entry);
+	if (futimens(fd, ts) < 0)
+		weprintf("futimens %s:", path);
+}
+
+/* Replace an installed regular file with an archive entry of the same
+ * size.  The data is compared with the file on disk as it's read and
+ * nothing is written unless they differ.  At the first difference the
+ * identical prefix is copied to the temporary file `tmp' which is then
+ * completed from the archive.  Return 1 if `tmp' has to be renamed over
+ * the old file, 0 if the file is unchanged and -1 on failure */
+static int
+pkg_update_file(struct archive *ar, struct archive_entry *entry,
+		const char *path, const char *tmp)
+{
+	char buf[BUFSIZ];
+	const void *blk;
+	char *cmp = NULL;
+	size_t len, cmpsz = 0;
+	la_int64_t off;
+	off_t pos = 0, o;
+	ssize_t n;
+	int fd, tfd = -1, r;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		weprintf("open %s:", path);
+		return -1;
+	}
 
-	if (archive_read_open_filename(ar, pkg->path, ARCHIVEBUFSIZ) < 0) {
-		weprintf("archive_read_open_filename %s: %s\n", pkg->path,
+	while ((r = archive_read_data_block(ar, &blk, &len, &off)) == ARCHIVE_OK) {
+		if (tfd < 0) {
+			if (len > cmpsz)
+				cmp = erealloc(cmp, cmpsz = len);
+			if (off == pos && pread(fd, cmp, len, off) == (ssize_t)len &&
+			    memcmp(cmp, blk, len) == 0) {
+				pos = off + len;
+				continue;
+			}
+			tfd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+			if (tfd < 0) {
+				weprintf("open %s:", tmp);
+				goto err;
+			}
+			for (o = 0; o < pos; o += n) {
+				n = pread(fd, buf, MIN(sizeof(buf), (size_t)(pos - o)), o);
+				if (n > 0)
+					bucket_take(&bytelimit, n);
+				if (n <= 0 || pwrite(tfd, buf, n, o) != n) {
+					weprintf("copy %s:", path);
+					goto err;
+				}
+			}
+		}
+		bucket_take(&bytelimit, len);
+		if (pwrite(tfd, blk, len, off) != (ssize_t)len) {
+			weprintf("write %s:", tmp);
+			goto err;
+		}
+	}
+	if (r != ARCHIVE_EOF) {
+		weprintf("archive_read_data_block %s: %s\n", path,
 			 archive_error_string(ar));
-		archive_read_free(ar);
+		goto err;
+	}
+	free(cmp);
+
+	if (tfd < 0) {
+		if (vflag == 1)
+			printf("unchanged %s\n", path);
+		fsetmeta(fd, entry, path);
+		close(fd);
+		return 0;
+	}
+	close(fd);
+	if (ftruncate(tfd, archive_entry_size(entry)) < 0)
+		weprintf("ftruncate %s:", tmp);
+	fsetmeta(tfd, entry, tmp);
+	close(tfd);
+	return 1;
+err:
+	free(cmp);
+	close(fd);
+	if (tfd >= 0) {
+		close(tfd);
+		unlink(tmp);
+	}
+	return -1;
+}
+
+/* Move an extracted entry from its temporary name into place.  Unless
+ * it is meant to replace an existing file, refuse to clobber anything
+ * that showed up since the collision checks */
+static int
+pkg_commit(const char *tmp, const char *path, int noreplace)
+{
+	if (!noreplace) {
+		if (rename(tmp, path) == 0)
+			return 0;
+	} else if (renameat2(AT_FDCWD, tmp, AT_FDCWD, path, RENAME_NOREPLACE) == 0) {
+		return 0;
+	} else if ((errno == EINVAL || errno == ENOSYS) && link(tmp, path) == 0) {
+		/* the filesystem can't do it, but link(2) never replaces */
+		unlink(tmp);
+		return 0;
+	}
+	if (errno == EEXIST)
+		weprintf("%s exists\n", path);
+	else
+		weprintf("rename %s:", tmp);
+	unlink(tmp);
+	return -1;
+}
+
+static void
+pending_add(struct pending **p, size_t *n, const char *tmp, const char *path,
+	    int noreplace)
+{
+	*p = erealloc(*p, (*n + 1) * sizeof(**p));
+	(*p)[*n].tmp = estrdup(tmp);
+	(*p)[*n].path = estrdup(path);
+	(*p)[*n].noreplace = noreplace;
+	(*n)++;
+}
+
+/* Rename all the entries extracted under a temporary name into place in
+ * one go, or throw them away if the installation failed */
+static int
+pending_commit(struct pending *p, size_t n, int discard)
+{
+	size_t i;
+	int r = 0;
+
+	for (i = 0; i < n; i++) {
+		if (discard)
+			unlink(p[i].tmp);
+		else if (pkg_commit(p[i].tmp, p[i].path, p[i].noreplace) < 0)
+			r = -1;
+		free(p[i].tmp);
+		free(p[i].path);
+	}
+	free(p);
+	return r;
+}
+
+/* With -c, extracted data is written back in windows of WBWINDOW bytes
+ * and dropped from the page cache once it is on disk, so installing a
+ * large package neither evicts the pages of everybody else nor leaves
+ * a backlog of dirty pages behind */
+#define WBWINDOW (8 * 1024 * 1024)
+
+static void
+wb_wait(int fd, off_t off, off_t len)
+{
+	if (sync_file_range(fd, off, len, SYNC_FILE_RANGE_WAIT_BEFORE |
+			    SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) == 0)
+		posix_fadvise(fd, off, len, POSIX_FADV_DONTNEED);
+}
+
+/* Wait for the files handed to wb_add() to be on disk and drop them */
+static void
+wb_flush(struct wback *wb)
+{
+	size_t i;
+
+	for (i = 0; i < wb->n; i++) {
+		wb_wait(wb->fd[i], 0, 0);
+		close(wb->fd[i]);
+	}
+	wb->n = 0;
+	wb->pending = 0;
+}
+
+/* Start writing back the last `len' bytes of a written file and take
+ * over `fd'.  Small files are waited for in batches */
+static void
+wb_add(struct wback *wb, int fd, off_t len)
+{
+	sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+	wb->fd[wb->n++] = fd;
+	wb->pending += len;
+	if (wb->n == LEN(wb->fd) || wb->pending >= WBWINDOW)
+		wb_flush(wb);
+}
+
+/* Write all of `buf', so a full disk is reported as such */
+static int
+pwriteall(int fd, const void *buf, size_t len, off_t off)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = pwrite(fd, p, len, off)) < 0)
+			return -1;
+		p += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+/* Extract a regular file for -c or a limited byte rate.  libarchive
+ * creates it empty, with all its checks of the path, and the data is
+ * written here one block at a time.  With -c, once a window is full its
+ * writeback is started and the window before it is waited for and
+ * dropped, so at most two are dirty.  On failure the file is removed
+ * rather than left behind incomplete */
+static int
+pkg_write_file(struct archive *disk, struct archive *ar,
+	       struct archive_entry *entry, int flags, struct wback *wb)
+{
+	struct archive_entry *e;
+	const char *path = archive_entry_pathname(entry);
+	const void *blk;
+	size_t len;
+	la_int64_t off;
+	off_t end = 0, started = 0, waited = 0;
+	int fd, r;
+
+	e = archive_entry_clone(entry);
+	archive_entry_set_size(e, 0);
+	archive_entry_set_perm(e, 0600);
+	archive_write_disk_set_options(disk, flags);
+	if ((r = archive_write_header(disk, e)) == ARCHIVE_OK)
+		r = archive_write_finish_entry(disk);
+	archive_entry_free(e);
+	if (r < ARCHIVE_WARN) {
+		weprintf("archive_write_header %s: %s\n", path,
+			 archive_error_string(disk));
+		return ARCHIVE_FAILED;
+	}
+	if ((fd = open(path, O_WRONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+		weprintf("open %s:", path);
+		unlink(path);
+		return ARCHIVE_FAILED;
+	}
+
+	while ((r = archive_read_data_block(ar, &blk, &len, &off)) == ARCHIVE_OK) {
+		bucket_take(&bytelimit, len);
+		if (pwriteall(fd, blk, len, off) < 0) {
+			weprintf("write %s:", path);
+			goto err;
+		}
+		end = off + len;
+		if (cflag && end - started >= WBWINDOW) {
+			sync_file_range(fd, started, end - started,
+					SYNC_FILE_RANGE_WRITE);
+			if (started > 0)
+				wb_wait(fd, waited, started - waited);
+			waited = started;
+			started = end;
+		}
+	}
+	if (r != ARCHIVE_EOF) {
+		weprintf("archive_read_data_block %s: %s\n", path,
+			 archive_error_string(ar));
+		goto err;
+	}
+	if (ftruncate(fd, archive_entry_size(entry)) < 0) {
+		weprintf("ftruncate %s:", path);
+		goto err;
+	}
+	fsetmeta(fd, entry, path);
+	if (cflag)
+		wb_add(wb, fd, archive_entry_size(entry) - waited);
+	else
+		close(fd);
+	return ARCHIVE_OK;
+err:
+	close(fd);
+	unlink(path);
+	return ARCHIVE_FAILED;
+}
+
+/* Files larger than this are written by the decoding thread itself,
+ * so the memory held by queued files stays bounded */
+#define WRITERMAX (1024 * 1024)
+
+static int
+writer_do(struct archive *disk, struct wjob *j)
+{
+	const char *name = archive_entry_pathname(j->entry);
+	int r = 0;
+
+	archive_write_disk_set_options(disk, j->flags);
+	if (archive_write_header(disk, j->entry) != ARCHIVE_OK ||
+	    (j->size > 0 &&
+	     archive_write_data(disk, j->buf, j->size) != (la_ssize_t)j->size) ||
+	    archive_write_finish_entry(disk) < ARCHIVE_WARN) {
+		weprintf("archive_write %s: %s\n", name,
+			 archive_error_string(disk));
+		if (j->path)
+			unlink(name);
+		r = -1;
+	} else if (j->path) {
+		r = pkg_commit(name, j->path, j->noreplace);
+	}
+	archive_entry_free(j->entry);
+	free(j->buf);
+	free(j->path);
+	return r;
+}
+
+static void *
+writer_run(void *arg)
+{
+	struct writer *w = arg;
+	struct writers *ws = w->ws;
+	struct wjob j;
+	int r;
+
+	pthread_mutex_lock(&ws->lock);
+	while (1) {
+		while (ws->count == 0 && !ws->done)
+			pthread_cond_wait(&ws->more, &ws->lock);
+		if (ws->count == 0)
+			break;
+		j = ws->ring[ws->head];
+		ws->head = (ws->head + 1) % WRITERJOBS;
+		ws->count--;
+		ws->busy++;
+		pthread_cond_signal(&ws->room);
+		pthread_mutex_unlock(&ws->lock);
+
+		r = writer_do(w->disk, &j);
+
+		pthread_mutex_lock(&ws->lock);
+		if (r < 0)
+			ws->errors++;
+		if (--ws->busy == 0 && ws->count == 0)
+			pthread_cond_broadcast(&ws->idle);
+	}
+	pthread_mutex_unlock(&ws->lock);
+	return NULL;
+}
+
+/* Start `n' writers.  The archive_write_disk objects are set up before
+ * any thread runs, as creating one briefly clears the umask */
+static struct writers *
+writers_new(size_t n)
+{
+	struct writers *ws;
+	size_t i;
+
+	ws = ecalloc(1, sizeof(*ws));
+	ws->w = ecalloc(n, sizeof(*ws->w));
+	pthread_mutex_init(&ws->lock, NULL);
+	pthread_cond_init(&ws->more, NULL);
+	pthread_cond_init(&ws->room, NULL);
+	pthread_cond_init(&ws->idle, NULL);
+	ws->n = n;
+	for (i = 0; i < n; i++) {
+		ws->w[i].disk = archive_write_disk_new();
+		archive_write_disk_set_standard_lookup(ws->w[i].disk);
+		ws->w[i].ws = ws;
+	}
+	for (i = 0; i < n; i++)
+		if ((errno = pthread_create(&ws->w[i].thread, NULL, writer_run,
+					    &ws->w[i])) != 0)
+			eprintf("pthread_create:");
+	return ws;
+}
+
+/* Read the data of a regular file and queue it for the writers.  With
+ * `path' set, the entry is renamed there once written.  Return 1 if it
+ * is too large to be queued */
+static int
+writers_queue(struct writers *ws, struct archive *ar,
+	      struct archive_entry *entry, int flags, const char *path,
+	      int noreplace)
+{
+	struct wjob j;
+	la_ssize_t n;
+	size_t off = 0;
+
+	if (!archive_entry_size_is_set(entry) ||
+	    archive_entry_size(entry) > WRITERMAX)
+		return 1;
+	j.size = archive_entry_size(entry);
+	bucket_take(&bytelimit, j.size);
+	j.buf = emalloc(MAX(j.size, 1));
+	while (off < j.size &&
+	       (n = archive_read_data(ar, (char *)j.buf + off, j.size - off)) > 0)
+		off += n;
+	if (off < j.size) {
+		weprintf("archive_read_data %s: %s\n",
+			 archive_entry_pathname(entry), archive_error_string(ar));
+		free(j.buf);
 		return -1;
 	}
+	j.entry = archive_entry_clone(entry);
+	j.flags = flags;
+	j.path = path ? estrdup(path) : NULL;
+	j.noreplace = noreplace;
+
+	pthread_mutex_lock(&ws->lock);
+	while (ws->count == WRITERJOBS)
+		pthread_cond_wait(&ws->room, &ws->lock);
+	ws->ring[(ws->head + ws->count) % WRITERJOBS] = j;
+	ws->count++;
+	pthread_cond_signal(&ws->more);
+	pthread_mutex_unlock(&ws->lock);
+	return 0;
+}
+
+/* Wait until everything queued is on disk */
+static void
+writers_drain(struct writers *ws)
+{
+	pthread_mutex_lock(&ws->lock);
+	while (ws->count > 0 || ws->busy > 0)
+		pthread_cond_wait(&ws->idle, &ws->lock);
+	pthread_mutex_unlock(&ws->lock);
+}
+
+/* Stop the writers.  Return -1 if any of their files failed */
+static int
+writers_free(struct writers *ws)
+{
+	size_t i;
+	int r;
+
+	pthread_mutex_lock(&ws->lock);
+	ws->done = 1;
+	pthread_cond_broadcast(&ws->more);
+	pthread_mutex_unlock(&ws->lock);
+	for (i = 0; i < ws->n; i++)
+		pthread_join(ws->w[i].thread, NULL);
+	for (i = 0; i < ws->n; i++) {
+		archive_write_close(ws->w[i].disk);
+		archive_write_free(ws->w[i].disk);
+	}
+	pthread_mutex_destroy(&ws->lock);
+	pthread_cond_destroy(&ws->more);
+	pthread_cond_destroy(&ws->room);
+	pthread_cond_destroy(&ws->idle);
+	r = ws->errors > 0 ? -1 : 0;
+	free(ws->w);
+	free(ws);
+	return r;
+}
+
+/* Extract an opened archive into the db root.  If `record' is set, the
+ * package entries are collected while extracting and checked for
+ * collisions one at a time, so the archive only has to be read once.
+ * If `old' is set, the archive replaces that package and files it
+ * already ships are only rewritten if their contents changed */
+static int
+pkg_extract(struct db *db, struct pkg *pkg, struct pkg *old,
+	    struct archive *ar, int record)
+{
+	struct archive_entry *entry;
+	struct pkgentry *pe;
+	struct pending *pending = NULL;
+	struct writers *ws = NULL;
+	struct archive *disk = NULL;
+	struct wback wb = { 0 };
+	struct stat sb;
+	char cwd[PATH_MAX], path[PATH_MAX], tmppath[PATH_MAX];
+	struct pathnode **oldset = NULL;
+	char *deps;
+	const char *tmp, *link;
+	size_t noldset = 0, npending = 0, i, sz;
+	int flags, replacing, noreplace, r;
 
 	if (!getcwd(cwd, sizeof(cwd))) {
 		weprintf("getcwd:");
-		archive_read_free(ar);
 		return -1;
 	}
 	if (chdir(db->root) < 0) {
 		weprintf("chdir %s:", db->root);
-		archive_read_free(ar);
 		return -1;
 	}
+	if (old)
+		oldset = pkg_nodes(old, &noldset);
+	if (cflag || bytelimit.rate > 0) {
+		disk = archive_write_disk_new();
+		archive_write_disk_set_standard_lookup(disk);
+	}
+	if (nwriters > 1) {
+		/* have the extraction of this thread set up before the
+		 * writers start, it clears the umask for a moment too */
+		archive_read_extract_set_progress_callback(ar, NULL, NULL);
+		ws = writers_new(nwriters);
+	}
 
 	while (1) {
 		r = archive_read_next_header(ar, &entry);
-		if (r == ARCHIVE_EOF)
+		if (r == ARCHIVE_EOF) {
+			r = 0;
 			break;
+		}
 		if (r != ARCHIVE_OK) {
 			weprintf("archive_read_next_header %s: %s\n",
-				 archive_entry_pathname(entry), archive_error_string(ar));
-			if (chdir(cwd) < 0)
-				weprintf("chdir %s:", cwd);
-			archive_read_free(ar);
-			return -1;
+				 pkg->path, archive_error_string(ar));
+			r = -1;
+			break;
+		}
+		tmp = archive_entry_pathname(entry);
+		if (strncmp(tmp, "./", 2) == 0)
+			tmp += 2;
+		if (strcmp(tmp, PKGDEPENDS) == 0) {
+			/* metadata, not installed */
+			if (record && (deps = readentry(ar, entry, &sz))) {
+				pkg_add_depends(pkg, deps);
+				free(deps);
+			}
+			continue;
+		}
+		replacing = old && inset(oldset, noldset, path_lookup(db, tmp));
+		if (record && tmp[0] != '\0') {
+			pe = pkgentry_new(db, tmp);
+			if (fflag == 0 && !replacing && pkgentry_collides(pe, pkg) == 1) {
+				pkgentry_free(pe);
+				r = -1;
+				break;
+			}
+			TAILQ_INSERT_TAIL(&pkg->pe_head, pe, entry);
 		}
 		if (rej_match(db, archive_entry_pathname(entry)) > 0) {
 			weprintf("rejecting %s\n", archive_entry_pathname(entry));
 			continue;
 		}
+		bucket_take(&filelimit, 1);
+		noreplace = fflag == 0 && !replacing;
+		if (replacing && archive_entry_filetype(entry) == AE_IFREG &&
+		    !archive_entry_hardlink(entry) && !strstr(tmp, "..")) {
+			estrlcpy(path, db->root, sizeof(path));
+			estrlcat(path, "/", sizeof(path));
+			estrlcat(path, tmp, sizeof(path));
+			estrlcpy(tmppath, path, sizeof(tmppath));
+			estrlcat(tmppath, ".pkgnew", sizeof(tmppath));
+			if (lstat(path, &sb) == 0 && S_ISREG(sb.st_mode) &&
+			    sb.st_size == archive_entry_size(entry)) {
+				if ((r = pkg_update_file(ar, entry, path, tmppath)) < 0)
+					break;
+				if (r == 0)
+					continue;
+				if (aflag == ATOMIC_BATCH)
+					pending_add(&pending, &npending, tmppath, path, 0);
+				else if ((r = pkg_commit(tmppath, path, 0)) < 0)
+					break;
+				continue;
+			}
+		}
 		flags = ARCHIVE_EXTRACT_OWNER | ARCHIVE_EXTRACT_PERM |
 			ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_SECURE_NODOTDOT;
-		if (fflag == 1)
+		if (fflag == 1 || replacing)
 			flags |= ARCHIVE_EXTRACT_UNLINK;
+		if (aflag != ATOMIC_NONE &&
+		    (archive_entry_filetype(entry) == AE_IFREG ||
+		     archive_entry_filetype(entry) == AE_IFLNK ||
+		     archive_entry_hardlink(entry))) {
+			/* extract next to the final path and rename it into
+			 * place, so nobody ever sees a partially written file */
+			estrlcpy(path, archive_entry_pathname(entry), sizeof(path));
+			estrlcpy(tmppath, path, sizeof(tmppath));
+			estrlcat(tmppath, ".pkgnew", sizeof(tmppath));
+			if ((link = archive_entry_hardlink(entry))) {
+				for (i = 0; i < npending; i++)
+					if (strcmp(pending[i].path, link) == 0)
+						break;
+				if (i < npending)
+					archive_entry_set_hardlink(entry, pending[i].tmp);
+			}
+			archive_entry_set_pathname(entry, tmppath);
+			/* a hard link needs its target on disk */
+			if (ws && archive_entry_hardlink(entry)) {
+				writers_drain(ws);
+			} else if (ws && archive_entry_filetype(entry) == AE_IFREG &&
+				   (r = writers_queue(ws, ar, entry,
+						      flags | ARCHIVE_EXTRACT_UNLINK,
+						      aflag == ATOMIC_FILE ? path : NULL,
+						      noreplace)) <= 0) {
+				if (r < 0)
+					break;
+				if (aflag == ATOMIC_BATCH)
+					pending_add(&pending, &npending, tmppath, path, noreplace);
+				continue;
+			}
+			if (disk && archive_entry_filetype(entry) == AE_IFREG &&
+			    !archive_entry_hardlink(entry)) {
+				if (pkg_write_file(disk, ar, entry,
+						   flags | ARCHIVE_EXTRACT_UNLINK,
+						   &wb) != ARCHIVE_OK) {
+					r = -1;
+					break;
+				}
+				r = ARCHIVE_OK;
+			} else if ((r = archive_read_extract(ar, entry, flags | ARCHIVE_EXTRACT_UNLINK)) != ARCHIVE_OK &&
+				   r != ARCHIVE_WARN) {
+				weprintf("archive_read_extract %s: %s\n",
+					 path, archive_error_string(ar));
+			}
+			if (r != ARCHIVE_OK && r != ARCHIVE_WARN) {
+				unlink(tmppath);
+			} else if (aflag == ATOMIC_BATCH) {
+				pending_add(&pending, &npending, tmppath, path, noreplace);
+			} else if ((r = pkg_commit(tmppath, path, noreplace)) < 0) {
+				break;
+			}
+			continue;
+		}
+		if (ws && archive_entry_hardlink(entry))
+			writers_drain(ws);
+		else if (ws && archive_entry_filetype(entry) == AE_IFREG &&
+			 (r = writers_queue(ws, ar, entry, flags, NULL, 0)) <= 0) {
+			if (r < 0)
+				break;
+			continue;
+		}
+		if (disk && archive_entry_filetype(entry) == AE_IFREG &&
+		    !archive_entry_hardlink(entry)) {
+			if (pkg_write_file(disk, ar, entry, flags, &wb) != ARCHIVE_OK) {
+				r = -1;
+				break;
+			}
+			continue;
+		}
 		r = archive_read_extract(ar, entry, flags);
 		if (r != ARCHIVE_OK && r != ARCHIVE_WARN)
 			weprintf("archive_read_extract %s: %s\n",
 				 archive_entry_pathname(entry), archive_error_string(ar));
 	}
 
-	archive_read_free(ar);
-
+	/* everything handed to the writers is on disk or failed now */
+	if (ws && writers_free(ws) < 0)
+		r = -1;
+	if (disk) {
+		wb_flush(&wb);
+		archive_write_free(disk);
+	}
+	if (pending_commit(pending, npending, r < 0) < 0)
+		r = -1;
+	free(oldset);
 	if (chdir(cwd) < 0) {
 		weprintf("chdir %s:", cwd);
 		return -1;
 	}
 
+	return r;
+}
+
+/* Register and install a package, replacing the installed package `old'
+ * if set.  If its files cannot be installed the new db entry is taken
+ * back, so `old' remains the installed version.  A failure to drop the
+ * entry of `old' comes after the new files are in place, so the new
+ * entry stays */
+int
+pkg_add(struct db *db, struct pkg *pkg, struct pkg *old)
+{
+	if (db_add(db, pkg) < 0)
+		return -1;
+	if (pkg_install(db, pkg, old) < 0) {
+		/* an entry of the same version is the one of `old' */
+		if (!(old && version_eq(old->version, pkg->version)))
+			db_unadd(db, pkg);
+		return -1;
+	}
+	if (old && pkg_replace(db, old, pkg) < 0)
+		return -1;
 	return 0;
 }
 
+/* Install a package, replacing the installed package `old' if set */
+int
+pkg_install(struct db *db, struct pkg *pkg, struct pkg *old)
+{
+	struct archive *ar;
+	int r;
+
+	ar = pkg_archive_new();
+
+	if (pkg_archive_open(ar, pkg->path) < 0) {
+		weprintf("archive_read_open %s: %s\n", pkg->path,
+			 archive_error_string(ar));
+		archive_read_free(ar);
+		return -1;
+	}
+
+	r = pkg_extract(db, pkg, old, ar, 0);
+	archive_read_free(ar);
+
+	return r;
+}
+
+/* Install a package read from `fd' in a single pass.  The package
+ * entries are filled in as the archive is extracted */
+int
+pkg_install_fd(struct db *db, struct pkg *pkg, struct pkg *old, int fd)
+{
+	struct archive *ar;
+	int r;
+
+	ar = pkg_archive_new();
+
+	if (archive_read_open_fd(ar, fd, ARCHIVEBUFSIZ) < 0) {
+		weprintf("archive_read_open_fd %s: %s\n", pkg->path,
+			 archive_error_string(ar));
+		archive_read_free(ar);
+		return -1;
+	}
+
+	r = pkg_extract(db, pkg, old, ar, 1);
+	archive_read_free(ar);
+
+	return r;
+}
+
 static int
 rm_empty_dir(const char *f, const struct stat *sb, int typeflag,
 	   struct FTW *ftwbuf)
@@ -209,91 +948,345 @@ rm_empty_dir(const char *f, const struct stat *sb, int typeflag,
 	if (typeflag == FTW_DP) {
 		if (vflag == 1)
 			printf("removing %s\n", f);
+		bucket_take(&filelimit, 1);
 		rmdir(f);
 	}
 	return 0;
 }
 
+struct rmentry {
+	struct pkgentry *pe;
+	size_t depth;
+};
+
+/* Deepest paths first, equal paths next to each other */
+static int
+cmprmentry(const void *a, const void *b)
+{
+	const struct rmentry *x = a, *y = b;
+	uintptr_t p = (uintptr_t)x->pe->node, q = (uintptr_t)y->pe->node;
+
+	if (x->depth != y->depth)
+		return x->depth < y->depth ? 1 : -1;
+	return p < q ? -1 : p > q;
+}
+
+/* State for foreign_cb(), nftw() has no way to pass it */
+static struct db *walkdb;
+static size_t walkrootlen;
+
+static int
+kept_cb(struct pathnode *n, void *data)
+{
+	char rpath[PATH_MAX];
+
+	if (n->owners)
+		return 1;
+	return rej_match(data, path_build(n, n->child != NULL, 0, rpath)) > 0;
+}
+
+static int
+foreign_cb(const char *f, const struct stat *sb, int typeflag,
+	   struct FTW *ftwbuf)
+{
+	(void) sb;
+	(void) ftwbuf;
+
+	if (typeflag == FTW_DNR || typeflag == FTW_NS)
+		return 1;
+	return !path_lookup(walkdb, f + walkrootlen);
+}
+
+/* A directory can be moved to the trash as a whole if nothing below it
+ * stays installed or is rejected, and everything below it on disk is
+ * known to the db.  Anything else has to stay where it is */
+static int
+trashable(struct db *db, struct pkgentry *pe, const char *path)
+{
+	struct stat sb;
+
+	if (!pe->node->parent || lstat(path, &sb) < 0 || !S_ISDIR(sb.st_mode))
+		return 0;
+	if (path_subtree(pe->node, kept_cb, db) != 0)
+		return 0;
+	walkdb = db;
+	walkrootlen = strcmp(db->root, "/") == 0 ? 0 : strlen(db->root);
+	return nftw(path, foreign_cb, 16, FTW_PHYS) == 0;
+}
+
+/* Return 1 if `n' is one of the directories in `dirs' or below one */
+static int
+moved(struct pathnode **dirs, size_t ndirs, const struct pathnode *n)
+{
+	size_t i;
+
+	for (; n; n = n->parent)
+		for (i = 0; i < ndirs; i++)
+			if (dirs[i] == n)
+				return 1;
+	return 0;
+}
+
+/* Remove the files of `n' packages in one pass.  A path shipped by more
+ * than one of them is only visited once, and with -f directories are
+ * pruned after all the files are gone, deepest first, unless a package
+ * that stays installed still owns them.
+ *
+ * If `trash' is set, files are renamed into it instead and with -f the
+ * topmost directories only the removed packages have files in are
+ * moved there as a whole, so the time taken does not depend on the
+ * size of the packages */
 int
-pkg_remove(struct db *db, struct pkg *pkg)
+pkg_remove(struct db *db, struct pkg **pkgs, size_t n, struct trash *trash)
 {
 	struct pkgentry *pe;
+	struct pathnode *node, **dirs = NULL;
+	struct rmentry *ents;
 	struct stat sb;
+	char path[PATH_MAX], rpath[PATH_MAX];
+	size_t nents = 0, ndirs = 0, i, j;
+
+	for (i = 0; i < n; i++)
+		TAILQ_FOREACH(pe, &pkgs[i]->pe_head, entry)
+			nents++;
+	ents = emalloc(MAX(nents, 1) * sizeof(*ents));
+	for (i = 0, j = 0; i < n; i++) {
+		TAILQ_FOREACH(pe, &pkgs[i]->pe_head, entry) {
+			ents[j].pe = pe;
+			ents[j].depth = 0;
+			for (node = pe->node; node->parent; node = node->parent)
+				ents[j].depth++;
+			j++;
+		}
+		db_disown(pkgs[i]);
+	}
+	qsort(ents, nents, sizeof(*ents), cmprmentry);
+	for (i = 0, j = 0; i < nents; i++)
+		if (j == 0 || ents[j - 1].pe->node != ents[i].pe->node)
+			ents[j++] = ents[i];
+	nents = j;
+
+	if (trash && fflag == 1) {
+		/* shallowest first, so the topmost directories are taken */
+		for (i = nents; i-- > 0;) {
+			pe = ents[i].pe;
+			if (moved(dirs, ndirs, pe->node))
+				continue;
+			if (!trashable(db, pe, pkgentry_path(pe, path)))
+				continue;
+			if (trash_move(trash, path) < 0)
+				continue;
+			if (vflag == 1)
+				printf("trashing %s\n", path);
+			dirs = erealloc(dirs, (ndirs + 1) * sizeof(*dirs));
+			dirs[ndirs++] = pe->node;
+		}
+	}
 
-	TAILQ_FOREACH_REVERSE(pe, &pkg->pe_head, pe_head, entry) {
-		if (rej_match(db, pe->rpath) > 0) {
-			weprintf("rejecting %s\n", pe->rpath);
+	for (i = 0; i < nents; i++) {
+		pe = ents[i].pe;
+		if (moved(dirs, ndirs, pe->node))
+			continue;
+		if (rej_match(db, pkgentry_rpath(pe, rpath)) > 0) {
+			weprintf("rejecting %s\n", rpath);
 			continue;
 		}
 
-		if (lstat(pe->path, &sb) < 0) {
-			weprintf("lstat %s:", pe->path);
+		pkgentry_path(pe, path);
+		if (lstat(path, &sb) < 0) {
+			weprintf("lstat %s:", path);
 			continue;
 		}
 
 		if (S_ISDIR(sb.st_mode) == 1) {
 			if (fflag == 0)
-				printf("ignoring directory %s\n", pe->path);
+				printf("ignoring directory %s\n", path);
 			/* We'll remove these further down in a separate pass */
 			continue;
 		}
 
 		if (S_ISLNK(sb.st_mode) == 1) {
 			if (fflag == 0) {
-				printf("ignoring link %s\n", pe->path);
+				printf("ignoring link %s\n", path);
 				continue;
 			}
 		}
 
+		if (trash && trash_move(trash, path) == 0) {
+			if (vflag == 1)
+				printf("trashing %s\n", path);
+			continue;
+		}
 		if (vflag == 1)
-			printf("removing %s\n", pe->path);
-		if (remove(pe->path) < 0)
-			weprintf("remove %s:", pe->path);
+			printf("removing %s\n", path);
+		bucket_take(&filelimit, 1);
+		if (remove(path) < 0)
+			weprintf("remove %s:", path);
 	}
 
 	if (fflag == 1) {
 		/* prune empty directories as well */
-		TAILQ_FOREACH_REVERSE(pe, &pkg->pe_head, pe_head, entry) {
-			if (rej_match(db, pe->rpath) > 0)
+		for (i = 0; i < nents; i++) {
+			pe = ents[i].pe;
+			if (moved(dirs, ndirs, pe->node))
+				continue;
+			if (rej_match(db, pkgentry_rpath(pe, rpath)) > 0)
 				continue;
-			if (db_links(db, pe->path) > 1)
+			if (path_owners(pe->node) > 0)
 				continue;
-			nftw(pe->path, rm_empty_dir, 1, FTW_DEPTH);
+			nftw(pkgentry_path(pe, path), rm_empty_dir, 1, FTW_DEPTH);
 		}
 	}
+	free(dirs);
+	free(ents);
 
-	TAILQ_REMOVE(&db->pkg_head, pkg, entry);
-	TAILQ_INSERT_TAIL(&db->pkg_rm_head, pkg, entry);
+	for (i = 0; i < n; i++) {
+		TAILQ_REMOVE(&db->pkg_head, pkgs[i], entry);
+		TAILQ_INSERT_TAIL(&db->pkg_rm_head, pkgs[i], entry);
+	}
 
 	return 0;
 }
 
-/* Check if the file entries of the package
- * collide with corresponding entries in the filesystem */
+/* Check if a package entry of `pkg' collides with a path shipped by
+ * another installed package or, for paths the db knows nothing about,
+ * with the corresponding entry in the filesystem.  Directories, those
+ * listed with a trailing slash, with paths below them or that are one
+ * on disk, are shared.  Return 1 on a collision, setting `owner' to the
+ * other package or to NULL for a file on disk, and 0 otherwise */
 int
-pkg_collisions(struct pkg *pkg)
+pkgentry_conflict(struct pkgentry *pe, struct pkg *pkg, struct pkg **owner)
 {
-	struct pkgentry *pe;
+	const struct owner *o;
 	struct stat sb;
-	char resolvedpath[PATH_MAX];
+	char path[PATH_MAX];
+
+	*owner = NULL;
+	for (o = pe->node->owners; o && o->pkg == pkg; o = o->next)
+		;
+	if (o) {
+		if (pe->dir || pe->node->child)
+			return 0;
+		/* an entry without a trailing slash, e.g. a symlink, may
+		 * still be a directory on disk and those are merged too */
+		if (stat(pkgentry_path(pe, path), &sb) == 0 &&
+		    S_ISDIR(sb.st_mode))
+			return 0;
+		*owner = o->pkg;
+		return 1;
+	}
+
+	pkgentry_path(pe, path);
+	if (access(path, F_OK) < 0)
+		return 0;
+	if (stat(path, &sb) < 0) {
+		weprintf("stat %s:", path);
+		return -1;
+	}
+	if (S_ISDIR(sb.st_mode) == 1)
+		return 0;
+	return 1;
+}
+
+/* Like pkgentry_conflict(), but report the collision */
+int
+pkgentry_collides(struct pkgentry *pe, struct pkg *pkg)
+{
+	struct pkg *owner;
+	char path[PATH_MAX], resolvedpath[PATH_MAX];
+	int r;
+
+	if ((r = pkgentry_conflict(pe, pkg, &owner)) != 1)
+		return r;
+	pkgentry_path(pe, path);
+	if (owner && owner->version)
+		weprintf("%s is owned by %s#%s\n", path, owner->name,
+			 owner->version);
+	else if (owner)
+		weprintf("%s is owned by %s\n", path, owner->name);
+	else if (realpath(path, resolvedpath))
+		weprintf("%s exists\n", resolvedpath);
+	else
+		weprintf("%s exists\n", path);
+	return 1;
+}
+
+/* Check if the file entries of the package collide with paths of
+ * installed packages or with corresponding entries in the filesystem.
+ * Entries of `old', the package being replaced, don't count */
+int
+pkg_collisions(struct pkg *pkg, struct pkg *old)
+{
+	struct pkgentry *pe;
+	struct pathnode **oldset = NULL;
+	size_t noldset = 0;
 	int r = 0;
 
+	if (old)
+		oldset = pkg_nodes(old, &noldset);
+
 	TAILQ_FOREACH(pe, &pkg->pe_head, entry) {
-		if (access(pe->path, F_OK) == 0) {
-			if (stat(pe->path, &sb) < 0) {
-				weprintf("lstat %s:", pe->path);
-				return -1;
-			}
-			if (S_ISDIR(sb.st_mode) == 0) {
-				if (realpath(pe->path, resolvedpath))
-					weprintf("%s exists\n", resolvedpath);
-				else
-					weprintf("%s exists\n", pe->path);
-				r = -1;
-			}
+		if (inset(oldset, noldset, pe->node))
+			continue;
+		switch (pkgentry_collides(pe, pkg)) {
+		case -1:
+			free(oldset);
+			return -1;
+		case 1:
+			r = -1;
+			break;
 		}
 	}
 
+	free(oldset);
+	return r;
+}
+
+/* Finish replacing `old' with `pkg' by removing the entries that are no
+ * longer part of the package as well as the old db entry */
+int
+pkg_replace(struct db *db, struct pkg *old, struct pkg *pkg)
+{
+	struct pkgentry *pe;
+	struct stat sb;
+	struct pathnode **newset;
+	char path[PATH_MAX];
+	size_t nnewset;
+	int r = 0;
+
+	newset = pkg_nodes(pkg, &nnewset);
+	TAILQ_FOREACH_REVERSE(pe, &old->pe_head, pe_head, entry) {
+		if (inset(newset, nnewset, pe->node))
+			continue;
+		if (rej_match(db, pkgentry_rpath(pe, path)) > 0)
+			continue;
+		if (db_links(db, pe) > 1)
+			continue;
+		if (lstat(pkgentry_path(pe, path), &sb) < 0)
+			continue;
+		if (vflag == 1)
+			printf("removing %s\n", path);
+		bucket_take(&filelimit, 1);
+		if (S_ISDIR(sb.st_mode)) {
+			if (rmdir(path) < 0 && errno != ENOTEMPTY &&
+			    errno != EEXIST)
+				weprintf("rmdir %s:", path);
+		} else if (remove(path) < 0) {
+			weprintf("remove %s:", path);
+		}
+	}
+	free(newset);
+
+	/* the new db entry already took the place of the old one */
+	if (!version_eq(old->version, pkg->version)) {
+		r = db_rm(db, old);
+		sync();
+	}
+
+	db_disown(old);
+	TAILQ_REMOVE(&db->pkg_head, old, entry);
+	TAILQ_INSERT_TAIL(&db->pkg_rm_head, old, entry);
+
 	return r;
 }
 
@@ -302,14 +1295,15 @@ pkg_new(const char *path, const char *name, const char *version)
 {
 	struct pkg *pkg;
 
-	pkg = emalloc(sizeof(*pkg));
+	pkg = ecalloc(1, sizeof(*pkg));
 	pkg->name = estrdup(name);
 	if (version)
 		pkg->version = estrdup(version);
 	else
 		pkg->version = NULL;
-	estrlcpy(pkg->path, path, sizeof(pkg->path));
+	pkg->path = estrdup(path);
 	TAILQ_INIT(&pkg->pe_head);
+	TAILQ_INIT(&pkg->dep_head);
 	return pkg;
 }
 
@@ -317,30 +1311,76 @@ void
 pkg_free(struct pkg *pkg)
 {
 	struct pkgentry *pe, *tmp;
+	struct pkgdep *dep, *dtmp;
+
+	/* released with the db */
+	if (pkg->arena)
+		return;
 
 	for (pe = TAILQ_FIRST(&pkg->pe_head); pe; pe = tmp) {
 		tmp = TAILQ_NEXT(pe, entry);
 		TAILQ_REMOVE(&pkg->pe_head, pe, entry);
 		pkgentry_free(pe);
 	}
+	for (dep = TAILQ_FIRST(&pkg->dep_head); dep; dep = dtmp) {
+		dtmp = TAILQ_NEXT(dep, entry);
+		TAILQ_REMOVE(&pkg->dep_head, dep, entry);
+		free(dep->name);
+		free(dep);
+	}
 	free(pkg->name);
 	free(pkg->version);
+	free(pkg->path);
 	free(pkg);
 }
 
+/* Add the dependencies listed in `buf', one package name per line.
+ * Empty lines and lines starting with '#' are ignored */
+void
+pkg_add_depends(struct pkg *pkg, char *buf)
+{
+	struct pkgdep *dep;
+	char *line, *next;
+
+	for (line = buf; line && *line; line = next) {
+		if ((next = strchr(line, '\n')))
+			*next++ = '\0';
+		line += strspn(line, " \t");
+		line[strcspn(line, " \t")] = '\0';
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+		dep = emalloc(sizeof(*dep));
+		dep->name = estrdup(line);
+		TAILQ_INSERT_TAIL(&pkg->dep_head, dep, entry);
+	}
+}
+
 struct pkgentry *
 pkgentry_new(struct db *db, const char *file)
 {
 	struct pkgentry *pe;
+	size_t len = strlen(file);
 
 	pe = emalloc(sizeof(*pe));
-	estrlcpy(pe->path, db->root, sizeof(pe->path));
-	estrlcat(pe->path, "/", sizeof(pe->path));
-	estrlcat(pe->path, file, sizeof(pe->path));
-	estrlcpy(pe->rpath, file, sizeof(pe->rpath));
+	pe->node = path_intern(db, file, len);
+	pe->dir = len > 0 && file[len - 1] == '/';
 	return pe;
 }
 
+/* Write the absolute path of an entry to `buf', of size PATH_MAX */
+char *
+pkgentry_path(const struct pkgentry *pe, char *buf)
+{
+	return path_build(pe->node, pe->dir, 1, buf);
+}
+
+/* Write the path of an entry relative to the db root to `buf' */
+char *
+pkgentry_rpath(const struct pkgentry *pe, char *buf)
+{
+	return path_build(pe->node, pe->dir, 0, buf);
+}
+
 void
 pkgentry_free(struct pkgentry *pe)
 {
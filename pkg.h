@@ -1,104 +1,437 @@
 /* See LICENSE file for copyright and license details. */
 #include <archive.h>
 #include <archive_entry.h>
+#include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <ftw.h>
 #include <limits.h>
+#include <pthread.h>
 #include <regex.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include "arg.h"
 #include "queue.h"
 
 #define LEN(x) (sizeof (x) / sizeof *(x))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 #define DBPATH        "/var/pkg"
 #define DBPATHREJECT  "/etc/pkgtools/reject.conf"
+#define PKGDSOCK      "/var/run/pkgd.sock"
 #define ARCHIVEBUFSIZ BUFSIZ
+#define WRITERJOBS    64		/* files decoded ahead of the writers */
+#define DELTAMETA     ".DELTA"
+#define DELTAPATCH    ".PATCH/"
+
+#define PKGDEPENDS    ".DEPENDS"	/* dependencies in a package */
+#define DBDEPENDS     ".depends"	/* dependencies in the db */
+
+#define DBSHARDED     ".sharded"	/* db entries live in DBSHARDS subdirectories */
+#define DBSHARDS      256
+#define DBGENERATION  ".generation"	/* counts changes to the db */
+#define DBCACHE       ".cache"
+#define DBSNAPSHOT    DBCACHE "/snapshot"	/* see snapshot.c */
+#define TRASHPATH     "/.pkgtrash"	/* removed files awaiting the reaper */
+#define MIRRORLIST    "PACKAGES"	/* package archives of a mirror */
+#define MIRRORINDEX   "PACKAGES.idx"	/* catalog of a mirror, see catalog.c */
+
+#define SHA256_DIGEST_LENGTH 32
+#define SHA256_HEX_LENGTH    (2 * SHA256_DIGEST_LENGTH + 1)
+
+struct owner {
+	struct pkg *pkg;
+	struct owner *next;
+};
+
+/* A path component in the trie of db paths, see path.c */
+struct pathslot {
+	size_t hash;
+	struct pathnode *node;
+};
+
+struct pathnode {
+	struct pathnode *parent;	/* NULL for the db root */
+	struct pathnode *child;		/* first child */
+	struct pathnode *sibling;	/* next child of the parent */
+	struct owner *owners;		/* installed packages shipping the path */
+	char name[];			/* component, the db root for the top node */
+};
 
 struct pkgentry {
-	char path[PATH_MAX];		/* absolute path of package entry */
-	char rpath[PATH_MAX];		/* relative path of package entry */
+	struct pathnode *node;		/* path of package entry */
+	int dir;			/* listed with a trailing slash */
 	TAILQ_ENTRY(pkgentry) entry;
 };
 
+struct pkgdep {
+	char *name;			/* name of the required package */
+	TAILQ_ENTRY(pkgdep) entry;
+};
+
 struct pkg {
 	char *name;			/* package name */
 	char *version;			/* package version */
-	char path[PATH_MAX];		/* path to package in db or .pkg.tgz */
+	char *path;			/* path to package in db or .pkg.tgz */
 	TAILQ_HEAD(pe_head, pkgentry) pe_head;
+	TAILQ_HEAD(dep_head, pkgdep) dep_head;
+	int arena;			/* allocated from the db arena */
 	TAILQ_ENTRY(pkg) entry;
 };
 
+struct pending {
+	char *tmp;			/* temporary name of an extracted entry */
+	char *path;			/* final name of the entry */
+	int noreplace;			/* fail instead of replacing an existing entry */
+};
+
+/* Batch of removed files renamed into the trash, see trash.c */
+struct trash {
+	char path[PATH_MAX];		/* batch directory */
+	unsigned long n;		/* entries moved into it */
+};
+
+/* Regular file decoded from an archive, waiting for a writer */
+struct wjob {
+	struct archive_entry *entry;
+	void *buf;
+	size_t size;
+	int flags;			/* archive_write_disk options */
+	char *path;			/* rename the entry here once written, or NULL */
+	int noreplace;
+};
+
+struct writer {
+	pthread_t thread;
+	struct archive *disk;
+	struct writers *ws;
+};
+
+/* Pool of threads writing out the files decoded by pkg_extract() */
+struct writers {
+	struct writer *w;
+	size_t n;
+	struct wjob ring[WRITERJOBS];
+	size_t head;			/* next job to take */
+	size_t count;			/* jobs in the ring */
+	size_t busy;			/* jobs being written */
+	size_t errors;			/* jobs that failed */
+	int done;
+	pthread_mutex_t lock;
+	pthread_cond_t more, room, idle;
+};
+
+/* Files written with -c whose writeback is under way, see pkg.c */
+struct wback {
+	int fd[64];
+	size_t n;
+	off_t pending;			/* bytes not waited for yet */
+};
+
+/* Token bucket limiting a rate, see throttle.c */
+struct bucketstate {
+	double tokens;
+	struct timespec last;		/* time of the last refill */
+	double taken;
+	double waited;			/* seconds spent sleeping */
+	pthread_mutex_t lock;
+};
+
+struct bucket {
+	const char *name;
+	double rate;			/* tokens per second, 0 for no limit */
+	struct bucketstate *s;		/* shared with forked processes */
+};
+
 struct rejrule {
 	regex_t preg;
 	TAILQ_ENTRY(rejrule) entry;
 };
 
+struct sha256 {
+	uint64_t len;			/* processed message length */
+	uint32_t h[8];			/* hash state */
+	uint8_t buf[64];		/* message block buffer */
+};
+
+struct chunk {
+	struct chunk *next;
+	size_t len;			/* bytes handed out */
+	size_t cap;			/* bytes available after the header */
+};
+
+/* Bump allocator, everything is released at once by arena_free() */
+struct arena {
+	struct chunk *head;
+	size_t size;			/* total bytes handed out */
+};
+
 struct db {
 	DIR *pkgdir;			/* opendir() handle for DBPATH */
+	int sharded;			/* entries live in DBPATH/xx/ */
+	int shard;			/* next shard to read by db_next() */
+	DIR *sharddir;			/* shard being read by db_next() */
 	char root[PATH_MAX];		/* db root to allow for installation in a mountpoint */
 	char path[PATH_MAX];		/* absolute path to DBPATH including db root */
 	TAILQ_HEAD(rejrule_head, rejrule) rejrule_head;
 	TAILQ_HEAD(pkg_head, pkg) pkg_head;
 	TAILQ_HEAD(pkg_rm_head, pkg) pkg_rm_head;
+	struct arena arena;		/* packages loaded from the db and paths */
+	struct pathnode *top;		/* trie of all paths known to the db */
+	struct pathslot *ptab;		/* hash table of trie nodes */
+	size_t ptabsz;
+	size_t npaths;
+	struct pathnode *lastdir;	/* last directory looked up */
+	char lastdirpath[PATH_MAX];
+	size_t lastdirlen;
+	char *buf;			/* db entries read by pkg_load() */
+	size_t bufsz;
+};
+
+/* Mirror catalog, see catalog.c */
+struct cathdr {
+	char magic[8];
+	uint32_t endian;
+	uint32_t npkgs;
+	uint32_t nfiles;
+	uint32_t ndeps;
+	uint32_t strsz;
+	uint32_t pad;
+};
+
+struct catpkg {
+	uint64_t size;			/* of the package archive */
+	uint8_t sha256[SHA256_DIGEST_LENGTH];
+	uint32_t file;			/* archive filename in the mirror */
+	uint32_t name;
+	uint32_t version;		/* the empty string for none */
+	uint32_t files;			/* index of the first file */
+	uint32_t nfiles;
+	uint32_t deps;			/* index of the first dependency */
+	uint32_t ndeps;
+	uint32_t pad;
+};
+
+struct catfile {
+	uint32_t path;			/* with a trailing slash for directories */
+	uint32_t pkg;
+};
+
+struct catalog {
+	void *map;
+	size_t size;
+	const struct cathdr *h;
+	const struct catpkg *pkgs;
+	const struct catfile *files;
+	const uint32_t *index;		/* files sorted by path */
+	const uint32_t *deps;		/* names of required packages */
+	const char *strs;
+};
+
+/* Catalog being built by mkindexpkg */
+struct catbuild {
+	struct catpkg *pkgs;
+	size_t npkgs;
+	struct catfile *files;
+	size_t nfiles;
+	uint32_t *deps;
+	size_t ndeps;
+	char *strs;
+	size_t strsz, strcap;
+	uint32_t *stab;			/* hash table of string offsets */
+	size_t stabsz, nstrs;
+};
+
+/* Patterns matched at once, see search.c */
+struct pattern {
+	regex_t preg;
+	char *lit;			/* literal all matches contain */
+	size_t litlen;			/* 0 if there is none */
+	int prefix;			/* the literal starts all matches */
+};
+
+struct search {
+	struct pattern *p;
+	size_t n;
+	size_t ngroups;			/* of 64 patterns */
+	uint64_t *one;			/* by the byte a literal starts with */
+	uint64_t *two;			/* by the two bytes a literal starts with */
+	uint64_t *always;		/* patterns without a literal */
+	int first;			/* byte all literals start with, or -1 */
+};
+
+enum {
+	ATOMIC_NONE,			/* extract entries in place */
+	ATOMIC_FILE,			/* rename each entry into place when extracted */
+	ATOMIC_BATCH			/* rename all entries into place at the end */
 };
 
 /* db.c */
+extern int aflag;
+extern int cflag;
 extern int fflag;
 extern int vflag;
+extern long nwriters;
 
 /* eprintf.c */
 extern char *argv0;
 
+/* catalog.c */
+int cat_map(struct catalog *, int);
+int cat_open(struct catalog *, const char *);
+void cat_close(struct catalog *);
+size_t cat_find(const struct catalog *, const char *, const uint32_t **);
+void cat_init(struct catbuild *);
+void cat_add(struct catbuild *, const struct pkg *, const char *, uint64_t,
+	     const uint8_t *, char **, size_t);
+int cat_save(struct catbuild *, const char *);
+void cat_free(struct catbuild *);
+
+/* client.c */
+int pkgd_addr(const char *, struct sockaddr_un *);
+int pkgd_query(const char *, FILE **, const char *, const char *);
+
 /* common.c */
-void parse_db_name(const char *, char **);
-void parse_db_version(const char *, char **);
+long estrtol(const char *, int);
+size_t parse_db_entry(const char *, const char **);
 void parse_name(const char *, char **);
 void parse_version(const char *, char **);
+int version_eq(const char *, const char *);
 
 /* db.c */
 struct db *db_new(const char *);
 int db_free(struct db *);
 int db_add(struct db *, struct pkg *);
+int db_unadd(struct db *, struct pkg *);
 int db_rm(struct db *, struct pkg *);
+unsigned db_shard(const char *);
+char *db_shardpath(struct db *, unsigned, char *);
+char *db_entrypath(struct db *, const char *, char *);
+void db_rewind(struct db *);
+struct dirent *db_next(struct db *);
+int db_lookup(struct db *, const char *, char *, size_t);
+uint64_t db_generation(struct db *);
 int db_load(struct db *);
 struct pkg *pkg_load_file(struct db *, const char *);
+struct pkg *db_find(struct db *, const char *);
+void db_state(struct db *, char *);
 int db_walk(struct db *, int (*)(struct db *, struct pkg *, void *), void *);
-int db_links(struct db *, const char *);
+int db_links(struct db *, struct pkgentry *);
+void db_own(struct db *, struct pkg *);
+void db_disown(struct pkg *);
+void db_unload(struct db *);
 
 /* ealloc.c */
 void *ecalloc(size_t, size_t);
 void *emalloc(size_t size);
 void *erealloc(void *, size_t);
 char *estrdup(const char *);
+void *arena_alloc(struct arena *, size_t);
+char *arena_strdup(struct arena *, const char *);
+char *arena_strndup(struct arena *, const char *, size_t);
+void arena_free(struct arena *);
+
+/* decomp.c */
+int pkg_archive_open(struct archive *, const char *);
+
+/* delta.c */
+void *diff_make(const void *, size_t, const void *, size_t, size_t *);
+void *diff_apply(const void *, size_t, const void *, size_t, size_t *);
+int delta_install(struct db *, const char *);
+void *readentry(struct archive *, struct archive_entry *, size_t *);
 
 /* eprintf.c */
 void enprintf(int, const char *, ...);
 void eprintf(const char *, ...);
 void weprintf(const char *, ...);
 
+/* path.c */
+struct pathnode *path_add(struct db *, struct pathnode *, const char *, size_t);
+void path_reserve(struct db *, size_t);
+struct pathnode *path_intern(struct db *, const char *, size_t);
+struct pathnode *path_lookup(struct db *, const char *);
+char *path_build(const struct pathnode *, int, int, char *);
+void path_own(struct db *, struct pathnode *, struct pkg *);
+void path_disown(struct pathnode *, struct pkg *);
+int path_owners(const struct pathnode *);
+int path_subtree(struct pathnode *, int (*)(struct pathnode *, void *), void *);
+void path_free(struct db *);
+
 /* pkg.c */
+struct archive *pkg_archive_new(void);
+void fsetmeta(int, struct archive_entry *, const char *);
 struct pkg *pkg_load(struct db *, const char *);
-int pkg_install(struct db *, struct pkg *);
-int pkg_remove(struct db *, struct pkg *);
-int pkg_collisions(struct pkg *);
+int pkg_add(struct db *, struct pkg *, struct pkg *);
+int pkg_install(struct db *, struct pkg *, struct pkg *);
+int pkg_install_fd(struct db *, struct pkg *, struct pkg *, int);
+int pkg_remove(struct db *, struct pkg **, size_t, struct trash *);
+int pkg_collisions(struct pkg *, struct pkg *);
+int pkg_replace(struct db *, struct pkg *, struct pkg *);
 struct pkg *pkg_new(const char *, const char *, const char *);
 void pkg_free(struct pkg *);
+void pkg_add_depends(struct pkg *, char *);
 struct pkgentry *pkgentry_new(struct db *, const char *);
+char *pkgentry_path(const struct pkgentry *, char *);
+char *pkgentry_rpath(const struct pkgentry *, char *);
 void pkgentry_free(struct pkgentry *);
+int pkgentry_conflict(struct pkgentry *, struct pkg *, struct pkg **);
+int pkgentry_collides(struct pkgentry *, struct pkg *);
 
 /* reject.c */
 void rej_free(struct db *);
 int rej_load(struct db *);
 int rej_match(struct db *, const char *);
 
+/* search.c */
+struct search *search_new(char **, size_t);
+int search_match(const struct search *, const char *, size_t);
+void search_free(struct search *);
+
+/* sha256.c */
+void sha256_init(struct sha256 *);
+void sha256_update(struct sha256 *, const void *, size_t);
+void sha256_sum(struct sha256 *, uint8_t *);
+void sha256_hex(const void *, size_t, char *);
+void sha256_tohex(const uint8_t *, char *);
+int sha256_digest(const char *, uint8_t *, uint64_t *);
+int sha256_file(const char *, char *);
+
+/* snapshot.c */
+int snap_load(struct db *, uint64_t, int64_t);
+void snap_save(struct db *, uint64_t, int64_t);
+
+/* throttle.c */
+extern struct bucket bytelimit;
+extern struct bucket filelimit;
+double parse_rate(const char *);
+void bucket_set(struct bucket *, double);
+void bucket_take(struct bucket *, double);
+void bucket_report(void);
+void bucket_poll(void);
+void bucket_interrupt(int);
+
+/* trash.c */
+int trash_open(struct db *, struct trash *);
+int trash_move(struct trash *, const char *);
+int trash_close(struct trash *);
+int trash_reap(const char *);
+void trash_spawn(const char *);
+
 /* strlcat.c */
 #undef strlcat
 size_t strlcat(char *, const char *, size_t);
@@ -0,0 +1,455 @@
+/* See LICENSE file for copyright and license details. */
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "pkg.h"
+
+/* Package entries indexed by device and inode number */
+struct inode {
+	dev_t dev;
+	ino_t ino;
+	struct pkg *pkg;
+	struct pkgentry *pe;
+	struct inode *next;
+};
+
+static struct db *db;
+static struct inode **itab;
+static size_t itabsz;
+static size_t ninodes;
+static size_t arenalive;		/* arena size after the last full load */
+static volatile sig_atomic_t done;
+
+static void
+usage(void)
+{
+	fprintf(stderr, VERSION " (c) 2014 morpheus engineers\n");
+	fprintf(stderr, "usage: %s [-v] [-r path]\n", argv0);
+	fprintf(stderr, "  -v    Enable verbose output\n");
+	fprintf(stderr, "  -r    Set alternative installation root\n");
+	exit(EXIT_FAILURE);
+}
+
+static void
+sighandler(int sig)
+{
+	(void) sig;
+
+	done = 1;
+}
+
+static size_t
+ihash(dev_t dev, ino_t ino)
+{
+	return ((uint64_t)dev * 31 + ino) * 0x9e3779b97f4a7c15ULL;
+}
+
+static void
+index_insert(struct inode *in)
+{
+	size_t h = ihash(in->dev, in->ino) & (itabsz - 1);
+
+	in->next = itab[h];
+	itab[h] = in;
+}
+
+static void
+index_grow(void)
+{
+	struct inode **old = itab, *in, *next;
+	size_t oldsz = itabsz, i;
+
+	itabsz = itabsz ? itabsz * 2 : 1024;
+	itab = ecalloc(itabsz, sizeof(*itab));
+	for (i = 0; i < oldsz; i++) {
+		for (in = old[i]; in; in = next) {
+			next = in->next;
+			index_insert(in);
+		}
+	}
+	free(old);
+}
+
+static void
+index_add(struct pkg *pkg)
+{
+	struct pkgentry *pe;
+	struct inode *in;
+	struct stat sb;
+	char path[PATH_MAX];
+
+	TAILQ_FOREACH(pe, &pkg->pe_head, entry) {
+		if (lstat(pkgentry_path(pe, path), &sb) < 0)
+			continue;
+		if (ninodes >= itabsz)
+			index_grow();
+		in = emalloc(sizeof(*in));
+		in->dev = sb.st_dev;
+		in->ino = sb.st_ino;
+		in->pkg = pkg;
+		in->pe = pe;
+		index_insert(in);
+		ninodes++;
+	}
+}
+
+/* Drop the entries of `pkg', or all of them if `pkg' is NULL */
+static void
+index_rm(struct pkg *pkg)
+{
+	struct inode **inp, *in;
+	size_t i;
+
+	for (i = 0; i < itabsz; i++) {
+		for (inp = &itab[i]; (in = *inp);) {
+			if (pkg && in->pkg != pkg) {
+				inp = &in->next;
+				continue;
+			}
+			*inp = in->next;
+			free(in);
+			ninodes--;
+		}
+	}
+}
+
+static void
+reload_all(void)
+{
+	struct pkg *pkg;
+
+	index_rm(NULL);
+	db_unload(db);
+	if (db_load(db) < 0)
+		weprintf("%s: failed to load db\n", db->path);
+	arenalive = db->arena.size;
+	TAILQ_FOREACH(pkg, &db->pkg_head, entry)
+		index_add(pkg);
+	if (vflag == 1)
+		printf("loaded %s\n", db->path);
+}
+
+/* Bring a single db entry up to date after it changed on disk */
+static void
+reload_pkg(const char *file)
+{
+	struct pkg *pkg, *tmp;
+	struct stat sb;
+	char path[PATH_MAX];
+	const char *p;
+
+	for (pkg = TAILQ_FIRST(&db->pkg_head); pkg; pkg = tmp) {
+		tmp = TAILQ_NEXT(pkg, entry);
+		p = strrchr(pkg->path, '/');
+		if (strcmp(p ? p + 1 : pkg->path, file) != 0)
+			continue;
+		index_rm(pkg);
+		db_disown(pkg);
+		TAILQ_REMOVE(&db->pkg_head, pkg, entry);
+		pkg_free(pkg);
+	}
+
+	if (stat(db_entrypath(db, file, path), &sb) < 0) {
+		if (vflag == 1)
+			printf("removed %s\n", path);
+		return;
+	}
+	if (!(pkg = pkg_load(db, file)))
+		return;
+	TAILQ_INSERT_TAIL(&db->pkg_head, pkg, entry);
+	db_own(db, pkg);
+	index_add(pkg);
+	if (vflag == 1)
+		printf("loaded %s\n", path);
+	/* packages are never freed individually, start over once most
+	 * of the arena is taken up by stale ones */
+	if (db->arena.size > 2 * arenalive + (1 << 20))
+		reload_all();
+}
+
+static int
+seen(struct pkg ***pkgs, size_t *n, struct pkg *pkg)
+{
+	size_t i;
+
+	for (i = 0; i < *n; i++)
+		if ((*pkgs)[i] == pkg)
+			return 1;
+	*pkgs = erealloc(*pkgs, (*n + 1) * sizeof(**pkgs));
+	(*pkgs)[(*n)++] = pkg;
+	return 0;
+}
+
+/* The client looks up the device and inode number of `path' itself, so
+ * nothing it names is ever accessed with the privileges of pkgd.  Only
+ * the entries of the db are, and those are public anyway */
+static void
+query_own(FILE *fp, char *arg)
+{
+	struct pkg **pkgs = NULL;
+	struct pathnode *node;
+	struct owner *o;
+	struct inode *in;
+	struct stat sb;
+	unsigned long long dev, ino;
+	char pepath[PATH_MAX], *path;
+	size_t n = 0, rootlen;
+
+	/* "dev ino path" */
+	errno = 0;
+	dev = strtoull(arg, &path, 10);
+	if (path == arg || *path != ' ')
+		goto invalid;
+	ino = strtoull(arg = path + 1, &path, 10);
+	if (errno != 0 || path == arg || *path != ' ' || path[1] != '/')
+		goto invalid;
+	path++;
+	fputs("ok\n", fp);
+
+	in = itabsz ? itab[ihash(dev, ino) & (itabsz - 1)] : NULL;
+	for (; in; in = in->next) {
+		if (in->dev != dev || in->ino != ino)
+			continue;
+		/* the index may be stale, make sure it's still the same file */
+		if (lstat(pkgentry_path(in->pe, pepath), &sb) < 0 ||
+		    sb.st_dev != dev || sb.st_ino != ino)
+			continue;
+		if (!seen(&pkgs, &n, in->pkg))
+			fprintf(fp, "%s is owned by %s\n", path, in->pkg->name);
+	}
+
+	/* files replaced behind our back are still found by their path */
+	rootlen = strlen(db->root);
+	if (n == 0 && strncmp(path, db->root, rootlen) == 0 &&
+	    (node = path_lookup(db, path + rootlen)) && node->parent) {
+		for (o = node->owners; o; o = o->next)
+			if (!seen(&pkgs, &n, o->pkg))
+				fprintf(fp, "%s is owned by %s\n", path,
+					o->pkg->name);
+	}
+	free(pkgs);
+	return;
+invalid:
+	fprintf(fp, "error invalid query\n");
+}
+
+static void
+query_list(FILE *fp)
+{
+	struct pkg *pkg;
+
+	fputs("ok\n", fp);
+	TAILQ_FOREACH(pkg, &db->pkg_head, entry) {
+		fputs(pkg->name, fp);
+		if (pkg->version)
+			fprintf(fp, "#%s", pkg->version);
+		fputc('\n', fp);
+	}
+}
+
+static void
+query_pkg(FILE *fp, const char *name, int files)
+{
+	struct pkg *pkg;
+	struct pkgentry *pe;
+	char path[PATH_MAX];
+	size_t n = 0;
+
+	if (!(pkg = db_find(db, name))) {
+		fprintf(fp, "error %s is not installed\n", name);
+		return;
+	}
+	fputs("ok\n", fp);
+	if (files) {
+		TAILQ_FOREACH(pe, &pkg->pe_head, entry)
+			fprintf(fp, "%s\n", pkgentry_path(pe, path));
+		return;
+	}
+	TAILQ_FOREACH(pe, &pkg->pe_head, entry)
+		n++;
+	fprintf(fp, "name %s\n", pkg->name);
+	if (pkg->version)
+		fprintf(fp, "version %s\n", pkg->version);
+	fprintf(fp, "files %zu\n", n);
+}
+
+/* Answer a single query of the form "command [argument]\n" */
+static void
+serve(int fd)
+{
+	struct timeval tv = { 5, 0 };
+	FILE *fp;
+	char *buf = NULL, *arg;
+	size_t sz = 0;
+	ssize_t len;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if (!(fp = fdopen(fd, "r+"))) {
+		close(fd);
+		return;
+	}
+	if ((len = getline(&buf, &sz, fp)) <= 0 || buf[len - 1] != '\n') {
+		free(buf);
+		fclose(fp);
+		return;
+	}
+	buf[len - 1] = '\0';
+	if ((arg = strchr(buf, ' ')))
+		*arg++ = '\0';
+
+	if (strcmp(buf, "own") == 0 && arg)
+		query_own(fp, arg);
+	else if (strcmp(buf, "list") == 0 && !arg)
+		query_list(fp);
+	else if (strcmp(buf, "info") == 0 && arg)
+		query_pkg(fp, arg, 0);
+	else if (strcmp(buf, "files") == 0 && arg)
+		query_pkg(fp, arg, 1);
+	else
+		fprintf(fp, "error invalid query\n");
+
+	free(buf);
+	fclose(fp);
+}
+
+#define DBEVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | \
+		  IN_ONLYDIR)
+
+/* Watch a shard of a sharded db.  A shard created while running may
+ * already hold entries by the time it is watched, so those are loaded */
+static void
+watch_shard(int ifd, const char *path, int scan)
+{
+	struct dirent *dp;
+	DIR *dir;
+
+	if (inotify_add_watch(ifd, path, DBEVENTS) < 0) {
+		if (errno != ENOENT)
+			weprintf("inotify_add_watch %s:", path);
+		return;
+	}
+	if (!scan || !(dir = opendir(path)))
+		return;
+	while ((dp = readdir(dir)))
+		if (dp->d_name[0] != '.')
+			reload_pkg(dp->d_name);
+	closedir(dir);
+}
+
+static void
+handle_events(int ifd)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char path[PATH_MAX];
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+
+	while ((len = read(ifd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				reload_all();
+			} else if (ev->len == 0 || ev->name[0] == '.') {
+				continue;
+			} else if (ev->mask & IN_ISDIR) {
+				if (!db->sharded ||
+				    !(ev->mask & (IN_CREATE | IN_MOVED_TO)))
+					continue;
+				estrlcpy(path, db->path, sizeof(path));
+				estrlcat(path, "/", sizeof(path));
+				estrlcat(path, ev->name, sizeof(path));
+				watch_shard(ifd, path, 1);
+			} else {
+				reload_pkg(ev->name);
+			}
+		}
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_un sun;
+	struct sigaction sa;
+	struct pollfd pfd[2];
+	char path[PATH_MAX], *root = "/";
+	unsigned i;
+	int sfd, ifd, cfd;
+
+	ARGBEGIN {
+	case 'v':
+		vflag = 1;
+		break;
+	case 'r':
+		root = ARGF();
+		break;
+	default:
+		usage();
+	} ARGEND;
+
+	if (argc > 0)
+		usage();
+
+	db = db_new(root);
+	if (!db)
+		exit(EXIT_FAILURE);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sighandler;
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, 0);
+
+	/* watch the db before loading it so no change is missed */
+	if ((ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+		eprintf("inotify_init1:");
+	if (inotify_add_watch(ifd, db->path, DBEVENTS | IN_CREATE) < 0)
+		eprintf("inotify_add_watch %s:", db->path);
+	for (i = 0; db->sharded && i < DBSHARDS; i++)
+		watch_shard(ifd, db_shardpath(db, i, path), 0);
+	reload_all();
+
+	if (pkgd_addr(db->root, &sun) < 0)
+		eprintf("%s%s: path too long\n", db->root, PKGDSOCK);
+	if ((sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		eprintf("socket:");
+	unlink(sun.sun_path);
+	if (bind(sfd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+		eprintf("bind %s:", sun.sun_path);
+	if (chmod(sun.sun_path, 0666) < 0)
+		weprintf("chmod %s:", sun.sun_path);
+	if (listen(sfd, SOMAXCONN) < 0)
+		eprintf("listen %s:", sun.sun_path);
+
+	pfd[0].fd = sfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ifd;
+	pfd[1].events = POLLIN;
+	while (!done) {
+		if (poll(pfd, LEN(pfd), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			weprintf("poll:");
+			break;
+		}
+		/* apply db changes before answering anything */
+		if (pfd[1].revents & POLLIN)
+			handle_events(ifd);
+		if (pfd[0].revents & POLLIN) {
+			if ((cfd = accept4(sfd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+				serve(cfd);
+		}
+	}
+
+	unlink(sun.sun_path);
+	close(sfd);
+	close(ifd);
+	index_rm(NULL);
+	free(itab);
+	db_free(db);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,556 @@
+/* See LICENSE file for copyright and license details. */
+#include "pkg.h"
+
+/*
+ * A plan lists what installing or removing packages would do, worked
+ * out from the package archives, the db and lstat() alone.  It is text,
+ * one action per line with the path last, relative to the root:
+ *
+ *	root <path>
+ *	state <sha256 of the sorted name#version list of the db>
+ *	flags <f or -><u or ->
+ *	install <sha256> <package archive>
+ *	uninstall <name#version>
+ *	create <bytes> <path>
+ *	overwrite <bytes> <path>
+ *	reject <path>
+ *	collide <owner#version or -> <path>
+ *	remove <path>
+ *	prune <path>
+ *
+ * followed by the totals as comments.  Applying a plan checks that the
+ * installed packages and the archives are the ones it was made with
+ * and trusts it for everything else, so the collision checks are not
+ * repeated on every host it is applied to.
+ */
+
+struct cost {
+	unsigned long create, overwrite, reject, collide, remove, prune;
+	long long bytes;
+};
+
+static int plan_install(struct db *, const char *, FILE *, struct cost *);
+static int plan_remove(struct db *, char **, int, FILE *, struct cost *);
+static int apply(const char *, const char *);
+
+static int uflag = 0;
+
+/* Packages planned so far, they own their paths so the packages after
+ * them see their files */
+static struct pkg **planned;
+static size_t nplanned;
+
+static void
+usage(void)
+{
+	fprintf(stderr, VERSION " (c) 2014 morpheus engineers\n");
+	fprintf(stderr, "usage: %s [-f] [-u] [-r path] pkg...\n", argv0);
+	fprintf(stderr, "       %s [-f] [-r path] -R name...\n", argv0);
+	fprintf(stderr, "       %s [-v] [-r path] -x plan\n", argv0);
+	fprintf(stderr, "  -f    Plan a forced installation or removal\n");
+	fprintf(stderr, "  -u    Plan upgrades of the installed packages\n");
+	fprintf(stderr, "  -R    Plan the removal of the named packages\n");
+	fprintf(stderr, "  -x    Apply a plan\n");
+	fprintf(stderr, "  -v    Enable verbose output\n");
+	fprintf(stderr, "  -r    Set alternative installation root\n");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct db *db;
+	struct cost c;
+	char *root = NULL, *plan = NULL, state[SHA256_HEX_LENGTH];
+	size_t j;
+	int Rflag = 0, i, r = 0;
+
+	ARGBEGIN {
+	case 'f':
+		fflag = 1;
+		break;
+	case 'u':
+		uflag = 1;
+		break;
+	case 'R':
+		Rflag = 1;
+		break;
+	case 'x':
+		plan = EARGF(usage());
+		break;
+	case 'v':
+		vflag = 1;
+		break;
+	case 'r':
+		root = ARGF();
+		break;
+	default:
+		usage();
+	} ARGEND;
+
+	if (plan) {
+		if (argc > 0 || fflag || uflag || Rflag)
+			usage();
+		return apply(plan, root) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+	if (argc < 1 || (Rflag && uflag))
+		usage();
+
+	db = db_new(root ? root : "/");
+	if (!db)
+		exit(EXIT_FAILURE);
+	if (db_load(db) < 0) {
+		db_free(db);
+		exit(EXIT_FAILURE);
+	}
+
+	db_state(db, state);
+	printf("root %s\n", db->root);
+	printf("state %s\n", state);
+	printf("flags %c%c\n", fflag ? 'f' : '-', uflag ? 'u' : '-');
+	memset(&c, 0, sizeof(c));
+	if (Rflag) {
+		r = plan_remove(db, argv, argc, stdout, &c);
+	} else {
+		for (i = 0; r == 0 && i < argc; i++)
+			r = plan_install(db, argv[i], stdout, &c);
+	}
+	printf("# create %lu overwrite %lu reject %lu collide %lu remove %lu prune %lu\n",
+	       c.create, c.overwrite, c.reject, c.collide, c.remove, c.prune);
+	printf("# bytes %lld\n", c.bytes);
+
+	for (j = 0; j < nplanned; j++) {
+		db_disown(planned[j]);
+		pkg_free(planned[j]);
+	}
+	free(planned);
+	db_free(db);
+	if (fflush(stdout) == EOF)
+		eprintf("fflush:");
+	return r < 0 || c.collide > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void
+pkgfile(const struct pkg *pkg, char *buf)
+{
+	estrlcpy(buf, pkg->name, PATH_MAX);
+	if (pkg->version) {
+		estrlcat(buf, "#", PATH_MAX);
+		estrlcat(buf, pkg->version, PATH_MAX);
+	}
+}
+
+static int
+owns(const struct pathnode *n, const struct pkg *pkg)
+{
+	const struct owner *o;
+
+	for (o = n->owners; o; o = o->next)
+		if (o->pkg == pkg)
+			return 1;
+	return 0;
+}
+
+/* Classify an entry of `pkg', which replaces `old' if set */
+static void
+plan_entry(struct db *db, struct pkg *pkg, struct pkg *old,
+	   struct pkgentry *pe, struct archive_entry *entry, FILE *fp,
+	   struct cost *c)
+{
+	struct pkg *o;
+	struct stat sb;
+	char path[PATH_MAX], rpath[PATH_MAX], owner[PATH_MAX];
+	long long size = 0;
+
+	pkgentry_rpath(pe, rpath);
+	if (rej_match(db, rpath) > 0) {
+		fprintf(fp, "reject %s\n", rpath);
+		c->reject++;
+		return;
+	}
+	if (archive_entry_filetype(entry) == AE_IFREG &&
+	    !archive_entry_hardlink(entry))
+		size = archive_entry_size(entry);
+
+	/* the checks installpkg does, entries of `old' are replaced.  Paths
+	 * of packages planned before own their nodes like installed ones */
+	if (fflag == 0 && !(old && owns(pe->node, old)) &&
+	    pkgentry_conflict(pe, pkg, &o) != 0) {
+		if (o)
+			pkgfile(o, owner);
+		fprintf(fp, "collide %s %s\n", o ? owner : "-", rpath);
+		c->collide++;
+		return;
+	}
+	if (lstat(pkgentry_path(pe, path), &sb) == 0) {
+		if (stat(path, &sb) == 0 && S_ISDIR(sb.st_mode))
+			return;
+		fprintf(fp, "overwrite %lld %s\n", size, rpath);
+		c->overwrite++;
+		c->bytes += size;
+		return;
+	}
+	fprintf(fp, "create %lld %s\n", size, rpath);
+	c->create++;
+	c->bytes += size;
+}
+
+/* The entries of `old' that `pkg' no longer ships, the way pkg_replace()
+ * removes them */
+static void
+plan_leftovers(struct db *db, struct pkg *old, struct pkg *pkg, FILE *fp,
+	       struct cost *c)
+{
+	struct pkgentry *pe;
+	struct stat sb;
+	char path[PATH_MAX], rpath[PATH_MAX];
+
+	TAILQ_FOREACH_REVERSE(pe, &old->pe_head, pe_head, entry) {
+		if (owns(pe->node, pkg))
+			continue;
+		if (rej_match(db, pkgentry_rpath(pe, rpath)) > 0)
+			continue;
+		if (db_links(db, pe) > 1)
+			continue;
+		if (lstat(pkgentry_path(pe, path), &sb) < 0)
+			continue;
+		if (S_ISDIR(sb.st_mode)) {
+			fprintf(fp, "prune %s\n", rpath);
+			c->prune++;
+		} else {
+			fprintf(fp, "remove %s\n", rpath);
+			c->remove++;
+		}
+	}
+}
+
+/* Plan the installation of the package archive `file'.  Only the
+ * headers of the archive are read */
+static int
+plan_install(struct db *db, const char *file, FILE *fp, struct cost *c)
+{
+	struct pkg *pkg, *old;
+	struct pkgentry *pe;
+	struct archive *ar;
+	struct archive_entry *entry;
+	char path[PATH_MAX], sum[SHA256_HEX_LENGTH];
+	const char *tmp;
+	char *name, *version;
+	int r;
+
+	if (!realpath(file, path)) {
+		weprintf("realpath %s:", file);
+		return -1;
+	}
+	if (sha256_file(path, sum) < 0) {
+		weprintf("read %s:", path);
+		return -1;
+	}
+	parse_name(path, &name);
+	parse_version(path, &version);
+	pkg = pkg_new(path, name, version);
+	free(name);
+	free(version);
+	old = uflag ? db_find(db, pkg->name) : NULL;
+	planned = erealloc(planned, (nplanned + 1) * sizeof(*planned));
+	planned[nplanned++] = pkg;
+
+	ar = pkg_archive_new();
+	if (pkg_archive_open(ar, pkg->path) < 0) {
+		weprintf("archive_read_open %s: %s\n", pkg->path,
+			 archive_error_string(ar));
+		archive_read_free(ar);
+		return -1;
+	}
+	fprintf(fp, "install %s %s\n", sum, pkg->path);
+	while ((r = archive_read_next_header(ar, &entry)) == ARCHIVE_OK) {
+		tmp = archive_entry_pathname(entry);
+		if (strncmp(tmp, "./", 2) == 0)
+			tmp += 2;
+		if (tmp[0] == '\0' || strcmp(tmp, PKGDEPENDS) == 0)
+			continue;
+		pe = pkgentry_new(db, tmp);
+		TAILQ_INSERT_TAIL(&pkg->pe_head, pe, entry);
+		plan_entry(db, pkg, old, pe, entry, fp, c);
+		path_own(db, pe->node, pkg);
+	}
+	if (r != ARCHIVE_EOF) {
+		weprintf("archive_read_next_header %s: %s\n", pkg->path,
+			 archive_error_string(ar));
+		archive_read_free(ar);
+		return -1;
+	}
+	archive_read_free(ar);
+	if (old)
+		plan_leftovers(db, old, pkg, fp, c);
+	return 0;
+}
+
+static int
+cmpnode(const void *a, const void *b)
+{
+	uintptr_t x = (uintptr_t)(*(struct pkgentry *const *)a)->node;
+	uintptr_t y = (uintptr_t)(*(struct pkgentry *const *)b)->node;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Plan the removal of the named packages, the way pkg_remove() does it */
+static int
+plan_remove(struct db *db, char **names, int n, FILE *fp, struct cost *c)
+{
+	struct pkg **pkgs, *pkg;
+	struct pkgentry **pes = NULL, *pe;
+	struct stat sb;
+	char path[PATH_MAX], rpath[PATH_MAX];
+	size_t npes = 0, i;
+	int j;
+
+	pkgs = emalloc(n * sizeof(*pkgs));
+	for (j = 0; j < n; j++) {
+		if (!(pkgs[j] = db_find(db, names[j]))) {
+			weprintf("%s is not installed\n", names[j]);
+			free(pkgs);
+			return -1;
+		}
+		pkgfile(pkgs[j], path);
+		fprintf(fp, "uninstall %s\n", path);
+	}
+	for (j = 0; j < n; j++) {
+		pkg = pkgs[j];
+		TAILQ_FOREACH(pe, &pkg->pe_head, entry) {
+			pes = erealloc(pes, (npes + 1) * sizeof(*pes));
+			pes[npes++] = pe;
+		}
+		db_disown(pkg);
+	}
+	free(pkgs);
+	if (npes > 0)
+		qsort(pes, npes, sizeof(*pes), cmpnode);
+
+	for (i = 0; i < npes; i++) {
+		pe = pes[i];
+		if (i > 0 && pes[i - 1]->node == pe->node)
+			continue;
+		if (rej_match(db, pkgentry_rpath(pe, rpath)) > 0) {
+			fprintf(fp, "reject %s\n", rpath);
+			c->reject++;
+			continue;
+		}
+		if (lstat(pkgentry_path(pe, path), &sb) < 0)
+			continue;
+		if (S_ISDIR(sb.st_mode)) {
+			/* only removed once empty */
+			if (fflag == 1 && path_owners(pe->node) == 0) {
+				fprintf(fp, "prune %s\n", rpath);
+				c->prune++;
+			}
+			continue;
+		}
+		if (S_ISLNK(sb.st_mode) && fflag == 0)
+			continue;
+		fprintf(fp, "remove %s\n", rpath);
+		c->remove++;
+	}
+	free(pes);
+	return 0;
+}
+
+struct planpkg {
+	char *arg;			/* archive or name#version */
+	char sum[SHA256_HEX_LENGTH];
+};
+
+struct plan {
+	char *root;
+	char state[SHA256_HEX_LENGTH];
+	int fflag, uflag;
+	struct planpkg *install, *uninstall;
+	size_t ninstall, nuninstall;
+	unsigned long ncollide;
+};
+
+static void
+plan_free(struct plan *p)
+{
+	size_t i;
+
+	for (i = 0; i < p->ninstall; i++)
+		free(p->install[i].arg);
+	for (i = 0; i < p->nuninstall; i++)
+		free(p->uninstall[i].arg);
+	free(p->install);
+	free(p->uninstall);
+	free(p->root);
+}
+
+static void
+plan_add(struct planpkg **v, size_t *n, const char *arg, const char *sum)
+{
+	*v = erealloc(*v, (*n + 1) * sizeof(**v));
+	(*v)[*n].arg = estrdup(arg);
+	(*v)[*n].sum[0] = '\0';
+	if (sum)
+		estrlcpy((*v)[*n].sum, sum, sizeof((*v)[*n].sum));
+	(*n)++;
+}
+
+static int
+plan_read(const char *file, struct plan *p)
+{
+	FILE *fp;
+	char *buf = NULL, *arg, *sp;
+	size_t sz = 0, line = 0;
+	ssize_t len;
+	int r = 0;
+
+	memset(p, 0, sizeof(*p));
+	if (!(fp = fopen(file, "r"))) {
+		weprintf("fopen %s:", file);
+		return -1;
+	}
+	while ((len = getline(&buf, &sz, fp)) != -1) {
+		line++;
+		if (len > 0 && buf[len - 1] == '\n')
+			buf[--len] = '\0';
+		if (buf[0] == '\0' || buf[0] == '#')
+			continue;
+		if (!(arg = strchr(buf, ' '))) {
+			weprintf("%s:%zu: malformed line\n", file, line);
+			r = -1;
+			break;
+		}
+		*arg++ = '\0';
+		if (strcmp(buf, "root") == 0) {
+			free(p->root);
+			p->root = estrdup(arg);
+		} else if (strcmp(buf, "state") == 0) {
+			estrlcpy(p->state, arg, sizeof(p->state));
+		} else if (strcmp(buf, "flags") == 0) {
+			p->fflag = strchr(arg, 'f') != NULL;
+			p->uflag = strchr(arg, 'u') != NULL;
+		} else if (strcmp(buf, "install") == 0) {
+			if (!(sp = strchr(arg, ' ')) ||
+			    sp - arg != SHA256_HEX_LENGTH - 1) {
+				weprintf("%s:%zu: malformed line\n", file, line);
+				r = -1;
+				break;
+			}
+			*sp++ = '\0';
+			plan_add(&p->install, &p->ninstall, sp, arg);
+		} else if (strcmp(buf, "uninstall") == 0) {
+			plan_add(&p->uninstall, &p->nuninstall, arg, NULL);
+		} else if (strcmp(buf, "collide") == 0) {
+			p->ncollide++;
+		}
+		/* the other actions follow from the packages */
+	}
+	if (ferror(fp)) {
+		weprintf("getline %s:", file);
+		r = -1;
+	}
+	free(buf);
+	fclose(fp);
+	if (r == 0 && (!p->root || p->state[0] == '\0')) {
+		weprintf("%s: not a plan\n", file);
+		r = -1;
+	}
+	return r;
+}
+
+/* Apply the plan in `file' to `root', or to the root it was made for */
+static int
+apply(const char *file, const char *root)
+{
+	struct plan p;
+	struct db *db;
+	struct pkg **pkgs = NULL, **rmpkgs = NULL, *pkg, *old;
+	char state[SHA256_HEX_LENGTH], sum[SHA256_HEX_LENGTH], path[PATH_MAX];
+	const char *version;
+	size_t len, i;
+	int r = -1;
+
+	if (plan_read(file, &p) < 0) {
+		plan_free(&p);
+		return -1;
+	}
+	if (p.ncollide > 0 && !p.fflag) {
+		weprintf("%s: %lu collisions\n", file, p.ncollide);
+		plan_free(&p);
+		return -1;
+	}
+	fflag = p.fflag;
+	uflag = p.uflag;
+
+	if (!(db = db_new(root ? root : p.root))) {
+		plan_free(&p);
+		return -1;
+	}
+	if (db_load(db) < 0)
+		goto out;
+	db_state(db, state);
+	if (strcmp(state, p.state) != 0) {
+		weprintf("%s: the installed packages differ from the plan\n", file);
+		goto out;
+	}
+
+	pkgs = ecalloc(MAX(p.ninstall, 1), sizeof(*pkgs));
+	rmpkgs = ecalloc(MAX(p.nuninstall, 1), sizeof(*rmpkgs));
+	for (i = 0; i < p.ninstall; i++) {
+		if (sha256_file(p.install[i].arg, sum) < 0) {
+			weprintf("read %s:", p.install[i].arg);
+			goto out;
+		}
+		if (strcmp(sum, p.install[i].sum) != 0) {
+			weprintf("%s: checksum mismatch\n", p.install[i].arg);
+			goto out;
+		}
+	}
+
+	/* the state matches, so every package to remove is installed */
+	for (i = 0; i < p.nuninstall; i++) {
+		len = parse_db_entry(p.uninstall[i].arg, &version);
+		if (len >= sizeof(path))
+			len = sizeof(path) - 1;
+		memcpy(path, p.uninstall[i].arg, len);
+		path[len] = '\0';
+		if (!(rmpkgs[i] = db_find(db, path))) {
+			weprintf("%s is not installed\n", path);
+			goto out;
+		}
+	}
+	if (p.nuninstall > 0) {
+		pkg_remove(db, rmpkgs, p.nuninstall, NULL);
+		for (i = 0; i < p.nuninstall; i++) {
+			if (db_rm(db, rmpkgs[i]) < 0)
+				goto out;
+			printf("removed %s\n", rmpkgs[i]->name);
+		}
+		sync();
+	}
+
+	/* no collision checks, the plan had none */
+	for (i = 0; i < p.ninstall; i++) {
+		if (!(pkgs[i] = pkg_load_file(db, p.install[i].arg)))
+			goto out;
+		pkg = pkgs[i];
+		if (vflag == 1)
+			printf("installing %s\n", pkg->path);
+		old = uflag ? db_find(db, pkg->name) : NULL;
+		if (pkg_add(db, pkg, old) < 0) {
+			printf("not installed %s\n", pkg->path);
+			goto out;
+		}
+		printf("installed %s\n", pkg->path);
+	}
+	r = 0;
+out:
+	for (i = 0; i < p.ninstall; i++)
+		if (pkgs && pkgs[i])
+			pkg_free(pkgs[i]);
+	free(pkgs);
+	free(rmpkgs);
+	db_free(db);
+	plan_free(&p);
+	return r;
+}
@@ -1,15 +1,30 @@
 /* See LICENSE file for copyright and license details. */
 #include "pkg.h"
 
-static int pkg_remove_cb(struct db *, struct pkg *, void *);
+static int
+cmppkg(const void *a, const void *b)
+{
+	return strcmp((*(struct pkg *const *)a)->name,
+		      (*(struct pkg *const *)b)->name);
+}
+
+static int
+cmpname(const void *key, const void *b)
+{
+	return strcmp(key, (*(struct pkg *const *)b)->name);
+}
 
 static void
 usage(void)
 {
 	fprintf(stderr, VERSION " (c) 2014 morpheus engineers\n");
-	fprintf(stderr, "usage: %s [-v] [-f] [-r path] pkg...\n", argv0);
+	fprintf(stderr, "usage: %s [-v] [-f] [-d] [-F rate] [-r path] pkg...\n", argv0);
+	fprintf(stderr, "       %s [-v] [-F rate] [-r path] -R\n", argv0);
 	fprintf(stderr, "  -v    Enable verbose output\n");
 	fprintf(stderr, "  -f    Force the removal of empty directories and symlinks\n");
+	fprintf(stderr, "  -d    Move the files to the trash and delete them in the background\n");
+	fprintf(stderr, "  -R    Delete the files in the trash now\n");
+	fprintf(stderr, "  -F    Remove at most rate files per second\n");
 	fprintf(stderr, "  -r    Set alternative installation root\n");
 	exit(EXIT_FAILURE);
 }
@@ -18,8 +33,12 @@ int
 main(int argc, char *argv[])
 {
 	struct db *db;
-	char *root = "/";
-	int i, r;
+	struct pkg *pkg, **byname, **pkgs, **found;
+	struct trash trash;
+	char *root = "/", *taken;
+	size_t npkgs, n, j;
+	int dflag = 0, Rflag = 0;
+	int i, r, removed;
 
 	ARGBEGIN {
 	case 'v':
@@ -28,6 +47,15 @@ main(int argc, char *argv[])
 	case 'f':
 		fflag = 1;
 		break;
+	case 'd':
+		dflag = 1;
+		break;
+	case 'R':
+		Rflag = 1;
+		break;
+	case 'F':
+		bucket_set(&filelimit, parse_rate(EARGF(usage())));
+		break;
 	case 'r':
 		root = ARGF();
 		break;
@@ -35,43 +63,74 @@ main(int argc, char *argv[])
 		usage();
 	} ARGEND;
 
-	if (argc < 1)
+	if (Rflag ? (argc > 0 || dflag || fflag) : argc < 1)
 		usage();
+	if (vflag == 1)
+		atexit(bucket_report);
 
 	db = db_new(root);
 	if (!db)
 		exit(EXIT_FAILURE);
+	if (Rflag) {
+		r = trash_reap(db->root);
+		db_free(db);
+		return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
 	r = db_load(db);
 	if (r < 0) {
 		db_free(db);
 		exit(EXIT_FAILURE);
 	}
 
-	for (i = 0; i < argc; i++) {
-		r = db_walk(db, pkg_remove_cb, argv[i]);
-		if (r < 0) {
-			db_free(db);
-			exit(EXIT_FAILURE);
-		} else if (r == 0) {
+	/* look all names up in the sorted package list, a name given
+	 * twice is not installed anymore the second time */
+	npkgs = 0;
+	TAILQ_FOREACH(pkg, &db->pkg_head, entry)
+		npkgs++;
+	byname = emalloc(MAX(npkgs, 1) * sizeof(*byname));
+	npkgs = 0;
+	TAILQ_FOREACH(pkg, &db->pkg_head, entry)
+		byname[npkgs++] = pkg;
+	qsort(byname, npkgs, sizeof(*byname), cmppkg);
+	taken = ecalloc(MAX(npkgs, 1), 1);
+	pkgs = emalloc(argc * sizeof(*pkgs));
+	for (i = 0, n = 0; i < argc; i++) {
+		found = bsearch(argv[i], byname, npkgs, sizeof(*byname), cmpname);
+		if (!found || taken[found - byname]) {
 			printf("%s is not installed\n", argv[i]);
+			continue;
 		}
+		taken[found - byname] = 1;
+		pkgs[n++] = *found;
 	}
+	free(taken);
+	free(byname);
 
+	if (n > 0 && dflag && trash_open(db, &trash) < 0)
+		dflag = 0;
+	r = pkg_remove(db, pkgs, n, n > 0 && dflag ? &trash : NULL);
+	if (n > 0 && dflag && trash_close(&trash) < 0)
+		r = -1;
+	removed = r == 0;
+	/* the files are gone, so every db entry goes even if one fails */
+	for (j = 0; removed && j < n; j++) {
+		if (db_rm(db, pkgs[j]) < 0)
+			r = -1;
+		else
+			printf("removed %s\n", pkgs[j]->name);
+	}
+	/* a single durability point for the whole batch.  With -d only the
+	 * filesystem of the db is flushed, so the removal does not wait for
+	 * unrelated writes */
+	if (n > 0 && dflag) {
+		if (syncfs(dirfd(db->pkgdir)) < 0)
+			weprintf("syncfs %s:", db->path);
+		trash_spawn(db->root);
+	} else if (n > 0) {
+		sync();
+	}
+	free(pkgs);
 	db_free(db);
 
-	return EXIT_SUCCESS;
-}
-
-static int
-pkg_remove_cb(struct db *db, struct pkg *pkg, void *name)
-{
-	if (strcmp(pkg->name, name) == 0) {
-		if (pkg_remove(db, pkg) < 0)
-			return -1;
-		if (db_rm(db, pkg) < 0)
-			return -1;
-		printf("removed %s\n", pkg->name);
-		return 1;
-	}
-	return 0;
+	return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,372 @@
+/* See LICENSE file for copyright and license details. */
+#include "pkg.h"
+
+/*
+ * Matching strings against many basic regular expressions at once, as
+ * searchpkg does with every name of a mirror.  Most patterns have a
+ * literal every match contains, so a string is scanned once for the
+ * literals of all patterns and regexec() only confirms the patterns
+ * whose literal turned up.
+ *
+ * The scan looks up each byte and each pair of bytes of the string in
+ * tables giving the patterns whose literal starts with them, as masks
+ * of 64 patterns.  If all literals start with the same byte, memchr()
+ * skips to its occurrences instead.
+ */
+
+#define PAIRS 4096
+
+static size_t
+pairhash(unsigned char a, unsigned char b)
+{
+	return ((size_t)a << 4 ^ b) & (PAIRS - 1);
+}
+
+/* Return the end of the bracket expression at `p', or NULL */
+static const char *
+skip_bracket(const char *p)
+{
+	char end[3] = { 0, ']', '\0' };
+
+	p++;
+	if (*p == '^')
+		p++;
+	if (*p == ']')
+		p++;
+	while (*p && *p != ']') {
+		if (p[0] == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+			end[0] = p[1];
+			if (!(p = strstr(p + 2, end)))
+				return NULL;
+			p += 2;
+		} else {
+			p++;
+		}
+	}
+	return *p ? p + 1 : NULL;
+}
+
+/* Parse the interval `\{m,n\}' at `p', n is -1 if unbounded.  Return
+ * its end or NULL if it is malformed */
+static const char *
+bre_interval(const char *p, long *m, long *n)
+{
+	char *end;
+
+	p += 2;
+	*m = isdigit((unsigned char)*p) ? strtol(p, &end, 10) : 0;
+	p = isdigit((unsigned char)*p) ? end : p;
+	*n = *m;
+	if (*p == ',') {
+		p++;
+		*n = isdigit((unsigned char)*p) ? strtol(p, &end, 10) : -1;
+		p = isdigit((unsigned char)*p) ? end : p;
+	}
+	return p[0] == '\\' && p[1] == '}' ? p + 2 : NULL;
+}
+
+/* Copy the basic regular expression `re', rewriting what grep(1)
+ * accepts but regcomp() does not.  grep takes a star or an interval
+ * after a repetition as repeating it again, `a\{1,2\}*' as
+ * `\(a\{1,2\}\)*'.  regcomp() does accept `\+' and `\?' there, so
+ * (y)* becomes y\+\? and the like.  Other intervals are written with a
+ * group, unless that would renumber back-references, then regcomp()
+ * refuses them.  An interval repeating nothing is ordinary text */
+static char *
+bre_squeeze(const char *re)
+{
+	const char *p = re, *end, *q;
+	char *out, *o;
+	size_t *groups, ngroups = 0, atom = 0, start;
+	long m, n;
+	int elem = 0, rep = 0, backrefs = 0, esc;
+
+	for (q = re; *q; q++) {
+		if (q[0] == '\\' && q[1]) {
+			backrefs |= q[1] >= '1' && q[1] <= '9';
+			q++;
+		}
+	}
+	/* a star becoming `\+\?' grows the most */
+	o = out = emalloc(4 * strlen(re) + 1);
+	groups = emalloc((strlen(re) / 2 + 1) * sizeof(*groups));
+	if (*p == '^')
+		*o++ = *p++;
+	while (*p) {
+		if (rep && *p == '*') {
+			memcpy(o, "\\+\\?", 4);
+			o += 4;
+			p++;
+			continue;
+		}
+		if (p[0] == '\\' && p[1] == '{' && (end = bre_interval(p, &m, &n))) {
+			if (!elem) {
+				for (q = p; q < end; q++)
+					if (*q != '\\')
+						*o++ = *q;
+				/* a repetition after it repeats the brace */
+				atom = o - out - 1;
+				elem = 1;
+				p = end;
+				continue;
+			}
+			if (rep && m <= 1 && (n < 0 || n == 1)) {
+				if (m == 0) {
+					memcpy(o, n < 0 ? "\\+\\?" : "\\?",
+					       n < 0 ? 4 : 2);
+					o += n < 0 ? 4 : 2;
+				} else if (n < 0) {
+					memcpy(o, "\\+", 2);
+					o += 2;
+				}
+				p = end;
+				continue;
+			}
+			if (rep && !backrefs) {
+				/* a caret starting a group is an anchor */
+				esc = out[atom] == '^';
+				memmove(out + atom + 2 + esc, out + atom,
+					o - out - atom);
+				memcpy(out + atom, "\\(\\", 2 + esc);
+				o += 2 + esc;
+				memcpy(o, "\\)", 2);
+				o += 2;
+			}
+		}
+		start = o - out;
+		if (p[0] == '\\' && p[1]) {
+			end = p + 2;
+			if (p[1] == '{' && (q = bre_interval(p, &m, &n)))
+				end = q;
+			/* a repetition without anything before it is an
+			 * ordinary character, as is a star after these */
+			rep = elem && strchr("+?{", p[1]);
+			if (!rep)
+				atom = start;
+			if (p[1] == '(')
+				groups[ngroups++] = start;
+			else if (p[1] == ')' && ngroups > 0)
+				atom = groups[--ngroups];
+			elem = p[1] != '(' && p[1] != '|';
+		} else if (*p == '[' && (end = skip_bracket(p))) {
+			atom = start;
+			elem = 1;
+			rep = 0;
+		} else if (*p == '^' && !elem && p - re >= 2 &&
+			   p[-2] == '\\' && (p[-1] == '(' || p[-1] == '|')) {
+			/* an anchor after `\(' or `\|', nothing to repeat */
+			end = p + 1;
+			rep = 0;
+		} else {
+			end = p + 1;
+			rep = *p == '*' && elem;
+			if (!rep)
+				atom = start;
+			elem = 1;
+		}
+		memcpy(o, p, end - p);
+		o += end - p;
+		p = end;
+	}
+	*o = '\0';
+	free(groups);
+	return out;
+}
+
+/* Find the longest run of literal characters every match of the basic
+ * regular expression `re' contains.  Return its length, 0 if there is
+ * none.  `prefix' is set if the run starts every match */
+static size_t
+bre_literal(const char *re, char *lit, size_t sz, int *prefix)
+{
+	const char *p = re, *body, *q;
+	char run[PATH_MAX];
+	size_t len = 0, best = 0;
+	int depth = 0, anchored, runprefix = 0, begin, opt, plus, c;
+
+	*prefix = 0;
+	anchored = *p == '^';
+	body = p += anchored;
+	while (*p) {
+		begin = p == body;
+		c = -1;
+		if (p[0] == '\\' && p[1]) {
+			if (p[1] == '|')
+				return 0;
+			if (p[1] == '(')
+				depth++;
+			else if (p[1] == ')')
+				depth--;
+			else if (!isalnum((unsigned char)p[1]) &&
+				 !strchr("{}<>`'?+", p[1]))
+				c = (unsigned char)p[1];
+			p += 2;
+		} else if (*p == '[') {
+			if (!(p = skip_bracket(p)))
+				return 0;
+		} else if (*p == '.' || (*p == '$' && p[1] == '\0')) {
+			p++;
+		} else {
+			/* a leading '*' is an ordinary character */
+			c = (unsigned char)*p++;
+		}
+
+		/* repetitions may repeat each other, `a\+\?' is `a*' */
+		opt = plus = 0;
+		for (;;) {
+			if (*p == '*') {
+				opt = 1;
+				p++;
+			} else if (p[0] == '\\' && p[1] == '?') {
+				opt = 1;
+				p += 2;
+			} else if (p[0] == '\\' && p[1] == '{') {
+				opt = 1;
+				q = strstr(p, "\\}");
+				p = q ? q + 2 : p + strlen(p);
+			} else if (p[0] == '\\' && p[1] == '+') {
+				plus = 1;
+				p += 2;
+			} else {
+				break;
+			}
+		}
+
+		/* anything in a group may be optional */
+		if (c >= 0 && !opt && depth == 0 && len < sizeof(run)) {
+			if (len == 0)
+				runprefix = anchored && begin;
+			run[len++] = c;
+			if (!plus)
+				continue;
+		}
+		if (len > best && len < sz) {
+			memcpy(lit, run, len);
+			best = len;
+			*prefix = runprefix;
+		}
+		len = 0;
+	}
+	if (len > best && len < sz) {
+		memcpy(lit, run, len);
+		best = len;
+		*prefix = runprefix;
+	}
+	return best;
+}
+
+/* Compile the basic regular expressions `res' */
+struct search *
+search_new(char **res, size_t n)
+{
+	struct search *s;
+	struct pattern *pt;
+	char lit[PATH_MAX], err[BUFSIZ], *re;
+	size_t i, g;
+	int r, first = -1;
+
+	s = ecalloc(1, sizeof(*s));
+	s->p = ecalloc(MAX(n, 1), sizeof(*s->p));
+	s->n = n;
+	s->ngroups = (n + 63) / 64;
+	s->one = ecalloc(MAX(s->ngroups, 1) * 256, sizeof(*s->one));
+	s->two = ecalloc(MAX(s->ngroups, 1) * PAIRS, sizeof(*s->two));
+	s->always = ecalloc(MAX(s->ngroups, 1), sizeof(*s->always));
+
+	for (i = 0; i < n; i++) {
+		pt = &s->p[i];
+		re = bre_squeeze(res[i]);
+		if ((r = regcomp(&pt->preg, re, REG_NOSUB)) != 0) {
+			regerror(r, &pt->preg, err, sizeof(err));
+			eprintf("%s: %s\n", res[i], err);
+		}
+		pt->litlen = bre_literal(re, lit, sizeof(lit), &pt->prefix);
+		free(re);
+		g = i / 64;
+		if (pt->litlen == 0) {
+			s->always[g] |= 1ULL << (i % 64);
+			continue;
+		}
+		pt->lit = emalloc(pt->litlen);
+		memcpy(pt->lit, lit, pt->litlen);
+		if (pt->litlen == 1)
+			s->one[g * 256 + (unsigned char)lit[0]] |= 1ULL << (i % 64);
+		else
+			s->two[g * PAIRS + pairhash(lit[0], lit[1])] |= 1ULL << (i % 64);
+		if (first == -1)
+			first = (unsigned char)lit[0];
+		else if (first != (unsigned char)lit[0])
+			first = -2;
+	}
+	s->first = first >= 0 ? first : -1;
+	return s;
+}
+
+/* Add the patterns of group `g' whose literal is at `off' of `str' */
+static uint64_t
+search_at(const struct search *s, size_t g, const char *str, size_t len,
+	  size_t off, uint64_t found)
+{
+	const struct pattern *pt;
+	const unsigned char *u = (const unsigned char *)str + off;
+	uint64_t m;
+	int b;
+
+	m = s->one[g * 256 + u[0]];
+	if (off + 1 < len)
+		m |= s->two[g * PAIRS + pairhash(u[0], u[1])];
+	for (m &= ~found; m; m &= m - 1) {
+		b = ffsll(m) - 1;
+		pt = &s->p[g * 64 + b];
+		if (pt->prefix && off > 0)
+			continue;
+		if (pt->litlen <= len - off &&
+		    memcmp(str + off, pt->lit, pt->litlen) == 0)
+			found |= 1ULL << b;
+	}
+	return found;
+}
+
+/* Return 1 if `str', NUL terminated and of length `len', matches any
+ * of the patterns */
+int
+search_match(const struct search *s, const char *str, size_t len)
+{
+	const char *q;
+	uint64_t found;
+	size_t g, off;
+	int b;
+
+	for (g = 0; g < s->ngroups; g++) {
+		found = s->always[g];
+		if (s->first >= 0) {
+			for (q = str; (q = memchr(q, s->first, len - (q - str))); q++)
+				found = search_at(s, g, str, len, q - str, found);
+		} else {
+			for (off = 0; off < len; off++)
+				found = search_at(s, g, str, len, off, found);
+		}
+		for (; found; found &= found - 1) {
+			b = ffsll(found) - 1;
+			if (regexec(&s->p[g * 64 + b].preg, str, 0, NULL, 0) == 0)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+void
+search_free(struct search *s)
+{
+	size_t i;
+
+	for (i = 0; i < s->n; i++) {
+		regfree(&s->p[i].preg);
+		free(s->p[i].lit);
+	}
+	free(s->p);
+	free(s->one);
+	free(s->two);
+	free(s->always);
+	free(s);
+}
@@ -0,0 +1,226 @@
+/* See LICENSE file for copyright and license details. */
+#include <curl/curl.h>
+#include <locale.h>
+#include "pkg.h"
+
+/* The mirror of $release and $arch unless $mirror is set */
+#define MIRRORURL "http://zandra.org/ports/%s/%s"
+
+static char mirror[PATH_MAX];
+static char **urls;
+static size_t nurls;
+
+static void
+usage(void)
+{
+	fprintf(stderr, VERSION " (c) 2014 morpheus engineers\n");
+	fprintf(stderr, "usage: %s [-i index] pattern...\n", argv0);
+	fprintf(stderr, "       %s [-i index] -o path...\n", argv0);
+	fprintf(stderr, "  -i    Search a local catalog or list of packages\n");
+	fprintf(stderr, "  -o    Look for the packages providing the given paths\n");
+	exit(EXIT_FAILURE);
+}
+
+static size_t
+write_cb(char *ptr, size_t size, size_t nmemb, void *data)
+{
+	return fwrite(ptr, size, nmemb, data);
+}
+
+/* Download `name' from the mirror to a temporary file */
+static FILE *
+fetch(const char *name, int quiet)
+{
+	CURL *curl;
+	CURLcode r;
+	FILE *fp;
+	char url[PATH_MAX];
+
+	estrlcpy(url, mirror, sizeof(url));
+	estrlcat(url, "/", sizeof(url));
+	estrlcat(url, name, sizeof(url));
+	if (!(fp = tmpfile()))
+		eprintf("tmpfile:");
+	if (!(curl = curl_easy_init()))
+		eprintf("curl_easy_init: failed\n");
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_cb);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
+	curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+	r = curl_easy_perform(curl);
+	curl_easy_cleanup(curl);
+	if (r == CURLE_OK && fflush(fp) == EOF)
+		r = CURLE_WRITE_ERROR;
+	if (r != CURLE_OK) {
+		if (!quiet)
+			weprintf("%s: %s\n", url, curl_easy_strerror(r));
+		fclose(fp);
+		return NULL;
+	}
+	return fp;
+}
+
+/* Queue the url of the package archive `name' */
+static void
+addurl(const char *name)
+{
+	char url[PATH_MAX], *p;
+
+	estrlcpy(url, mirror, sizeof(url));
+	estrlcat(url, "/", sizeof(url));
+	/* make room to escape the first '#' of the name */
+	if (strlen(url) + strlen(name) + 2 >= sizeof(url))
+		eprintf("%s: name too long\n", name);
+	estrlcat(url, name, sizeof(url));
+	if ((p = strchr(url, '#'))) {
+		memmove(p + 3, p + 1, strlen(p + 1) + 1);
+		memcpy(p, "%23", 3);
+	}
+	urls = erealloc(urls, (nurls + 1) * sizeof(*urls));
+	urls[nurls++] = estrdup(url);
+}
+
+static int
+cmpurl(const void *a, const void *b)
+{
+	return strcoll(*(char *const *)a, *(char *const *)b);
+}
+
+/* Print the queued urls sorted like sort(1) would, each once */
+static void
+printurls(void)
+{
+	size_t i;
+
+	if (nurls > 0)
+		qsort(urls, nurls, sizeof(*urls), cmpurl);
+	for (i = 0; i < nurls; i++)
+		if (i == 0 || strcmp(urls[i - 1], urls[i]) != 0)
+			puts(urls[i]);
+	for (i = 0; i < nurls; i++)
+		free(urls[i]);
+	free(urls);
+}
+
+/* Match the package names of a catalog */
+static void
+search_cat(const struct catalog *cat, struct search *s)
+{
+	const char *name;
+	uint32_t i;
+
+	for (i = 0; i < cat->h->npkgs; i++) {
+		name = cat->strs + cat->pkgs[i].file;
+		if (search_match(s, name, strlen(name)))
+			addurl(name);
+	}
+}
+
+/* Match the lines of a list of packages */
+static void
+search_list(FILE *fp, struct search *s)
+{
+	char *buf = NULL;
+	size_t sz = 0;
+	ssize_t len;
+
+	while ((len = getline(&buf, &sz, fp)) != -1) {
+		if (len > 0 && buf[len - 1] == '\n')
+			buf[--len] = '\0';
+		if (search_match(s, buf, len))
+			addurl(buf);
+	}
+	free(buf);
+}
+
+/* Queue the packages providing `path' */
+static void
+provides(const struct catalog *cat, const char *path)
+{
+	const uint32_t *idx;
+	char dir[PATH_MAX];
+	size_t n, i;
+
+	/* a directory is listed with a trailing slash */
+	if (!(n = cat_find(cat, path, &idx))) {
+		estrlcpy(dir, path, sizeof(dir));
+		estrlcat(dir, "/", sizeof(dir));
+		n = cat_find(cat, dir, &idx);
+	}
+	if (n == 0)
+		weprintf("%s is not provided by any package\n", path);
+	for (i = 0; i < n; i++)
+		addurl(cat->strs + cat->pkgs[cat->files[idx[i]].pkg].file);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct catalog cat;
+	struct search *s;
+	FILE *fp = NULL;
+	char *index = NULL, *release, *arch, *env;
+	int oflag = 0, iscat, i;
+
+	setlocale(LC_COLLATE, "");
+
+	ARGBEGIN {
+	case 'i':
+		index = EARGF(usage());
+		break;
+	case 'o':
+		oflag = 1;
+		break;
+	default:
+		usage();
+	} ARGEND;
+
+	if (argc < 1)
+		usage();
+
+	if ((env = getenv("mirror")) && env[0] != '\0') {
+		estrlcpy(mirror, env, sizeof(mirror));
+	} else {
+		if (!(release = getenv("release")) || release[0] == '\0')
+			release = "0.0";
+		if (!(arch = getenv("arch")) || arch[0] == '\0')
+			arch = "x86_64";
+		snprintf(mirror, sizeof(mirror), MIRRORURL, release, arch);
+	}
+
+	if (index) {
+		if (!(fp = fopen(index, "r")))
+			eprintf("fopen %s:", index);
+	} else {
+		if (curl_global_init(CURL_GLOBAL_DEFAULT) != 0)
+			eprintf("curl_global_init: failed\n");
+		/* mirrors without a catalog only have the list */
+		if (!(fp = fetch(MIRRORINDEX, 1)) && !(fp = fetch(MIRRORLIST, 0)))
+			exit(EXIT_FAILURE);
+		curl_global_cleanup();
+	}
+	iscat = cat_map(&cat, fileno(fp)) == 0;
+
+	if (oflag) {
+		if (!iscat)
+			eprintf("looking up paths needs a catalog\n");
+		for (i = 0; i < argc; i++)
+			provides(&cat, argv[i]);
+	} else {
+		s = search_new(argv, argc);
+		if (iscat) {
+			search_cat(&cat, s);
+		} else {
+			rewind(fp);
+			search_list(fp, s);
+		}
+		search_free(s);
+	}
+	if (iscat)
+		cat_close(&cat);
+	fclose(fp);
+
+	printurls();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,169 @@
+/* See LICENSE file for copyright and license details. */
+#include "pkg.h"
+
+static const uint32_t k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ror(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+processblock(struct sha256 *s, const uint8_t *buf)
+{
+	uint32_t w[64], t1, t2, a, b, c, d, e, f, g, h;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = (uint32_t)buf[4 * i] << 24;
+		w[i] |= (uint32_t)buf[4 * i + 1] << 16;
+		w[i] |= (uint32_t)buf[4 * i + 2] << 8;
+		w[i] |= buf[4 * i + 3];
+	}
+	for (; i < 64; i++) {
+		t1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		t2 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		w[i] = t1 + w[i - 7] + t2 + w[i - 16];
+	}
+	a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3];
+	e = s->h[4]; f = s->h[5]; g = s->h[6]; h = s->h[7];
+	for (i = 0; i < 64; i++) {
+		t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) +
+		     ((e & f) ^ (~e & g)) + k[i] + w[i];
+		t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) +
+		     ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+	s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+void
+sha256_init(struct sha256 *s)
+{
+	s->len = 0;
+	s->h[0] = 0x6a09e667;
+	s->h[1] = 0xbb67ae85;
+	s->h[2] = 0x3c6ef372;
+	s->h[3] = 0xa54ff53a;
+	s->h[4] = 0x510e527f;
+	s->h[5] = 0x9b05688c;
+	s->h[6] = 0x1f83d9ab;
+	s->h[7] = 0x5be0cd19;
+}
+
+void
+sha256_update(struct sha256 *s, const void *m, size_t len)
+{
+	const uint8_t *p = m;
+	unsigned r = s->len % 64;
+
+	s->len += len;
+	if (r) {
+		if (len < 64 - r) {
+			memcpy(s->buf + r, p, len);
+			return;
+		}
+		memcpy(s->buf + r, p, 64 - r);
+		len -= 64 - r;
+		p += 64 - r;
+		processblock(s, s->buf);
+	}
+	for (; len >= 64; len -= 64, p += 64)
+		processblock(s, p);
+	memcpy(s->buf, p, len);
+}
+
+void
+sha256_sum(struct sha256 *s, uint8_t *md)
+{
+	unsigned r = s->len % 64;
+	uint64_t bits = s->len * 8;
+	int i;
+
+	s->buf[r++] = 0x80;
+	if (r > 56) {
+		memset(s->buf + r, 0, 64 - r);
+		r = 0;
+		processblock(s, s->buf);
+	}
+	memset(s->buf + r, 0, 56 - r);
+	for (i = 0; i < 8; i++)
+		s->buf[56 + i] = bits >> (56 - 8 * i);
+	processblock(s, s->buf);
+
+	for (i = 0; i < 8; i++) {
+		md[4 * i] = s->h[i] >> 24;
+		md[4 * i + 1] = s->h[i] >> 16;
+		md[4 * i + 2] = s->h[i] >> 8;
+		md[4 * i + 3] = s->h[i];
+	}
+}
+
+/* Hash a buffer and return the digest as a hex string */
+void
+sha256_hex(const void *m, size_t len, char *hex)
+{
+	struct sha256 s;
+	uint8_t md[SHA256_DIGEST_LENGTH];
+
+	sha256_init(&s);
+	sha256_update(&s, m, len);
+	sha256_sum(&s, md);
+	sha256_tohex(md, hex);
+}
+
+void
+sha256_tohex(const uint8_t *md, char *hex)
+{
+	int i;
+
+	for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+		sprintf(hex + 2 * i, "%02x", md[i]);
+}
+
+/* Hash the contents of a file, also storing its length in `size'
+ * unless it is NULL */
+int
+sha256_digest(const char *path, uint8_t *md, uint64_t *size)
+{
+	struct sha256 s;
+	char buf[BUFSIZ];
+	uint64_t len = 0;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	sha256_init(&s);
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		sha256_update(&s, buf, n);
+		len += n;
+	}
+	close(fd);
+	if (n < 0)
+		return -1;
+	sha256_sum(&s, md);
+	if (size)
+		*size = len;
+	return 0;
+}
+
+/* Hash the contents of a file and return the digest as a hex string */
+int
+sha256_file(const char *path, char *hex)
+{
+	uint8_t md[SHA256_DIGEST_LENGTH];
+
+	if (sha256_digest(path, md, NULL) < 0)
+		return -1;
+	sha256_tohex(md, hex);
+	return 0;
+}
@@ -0,0 +1,297 @@
+/* See LICENSE file for copyright and license details. */
+#include "pkg.h"
+
+/*
+ * A snapshot is a copy of the loaded db in a single file, so a warm
+ * start maps one file instead of reading every db entry.  It holds no
+ * pointers: nodes refer to their parent and packages to their entries
+ * by index, and names are offsets into a string table.  Nodes are
+ * stored parents first, the top node being the first one.
+ *
+ * A snapshot is only used if it was taken at the generation of the db
+ * and DBPATH was not modified since.
+ */
+
+#define SNAPMAGIC "PKGSNAP1"
+#define SNAPDIR   (1U << 31)		/* entry listed with a trailing slash */
+
+struct snaphdr {
+	char magic[8];
+	uint64_t generation;
+	int64_t mtime;			/* of DBPATH in nanoseconds */
+	uint32_t sharded;
+	uint32_t nnodes;
+	uint32_t npkgs;
+	uint32_t nentries;
+	uint32_t strsz;
+};
+
+struct snapnode {
+	uint32_t parent;
+	uint32_t name;
+};
+
+struct snappkg {
+	uint32_t file;			/* db entry, i.e. name#version */
+	uint32_t entry;			/* index of the first entry */
+	uint32_t nentries;
+};
+
+struct nodeidx {
+	struct pathnode *node;
+	uint32_t idx;
+};
+
+static void
+snap_path(struct db *db, char *path)
+{
+	estrlcpy(path, db->path, PATH_MAX);
+	estrlcat(path, "/" DBSNAPSHOT, PATH_MAX);
+}
+
+/* Check that all indices and offsets of the snapshot are in range */
+static int
+snap_valid(const struct snaphdr *h, size_t size)
+{
+	const struct snapnode *nodes;
+	const struct snappkg *pkgs;
+	const uint32_t *ents;
+	const char *strs;
+	uint32_t i;
+
+	if ((uint64_t)sizeof(*h) + (uint64_t)h->nnodes * sizeof(*nodes) +
+	    (uint64_t)h->npkgs * sizeof(*pkgs) +
+	    (uint64_t)h->nentries * sizeof(*ents) + h->strsz != size)
+		return 0;
+	nodes = (const void *)(h + 1);
+	pkgs = (const void *)(nodes + h->nnodes);
+	ents = (const void *)(pkgs + h->npkgs);
+	strs = (const void *)(ents + h->nentries);
+	if (h->nnodes == 0 || h->strsz == 0 || strs[h->strsz - 1] != '\0')
+		return 0;
+	for (i = 0; i < h->nnodes; i++) {
+		if (nodes[i].name >= h->strsz)
+			return 0;
+		if (i > 0 && nodes[i].parent >= i)
+			return 0;
+	}
+	for (i = 0; i < h->npkgs; i++) {
+		if (pkgs[i].file >= h->strsz ||
+		    pkgs[i].entry > h->nentries ||
+		    pkgs[i].nentries > h->nentries - pkgs[i].entry)
+			return 0;
+	}
+	for (i = 0; i < h->nentries; i++)
+		if ((ents[i] & ~SNAPDIR) >= h->nnodes)
+			return 0;
+	return 1;
+}
+
+/* Load the db from its snapshot.  Return -1 and leave the db untouched
+ * if there is no usable one */
+int
+snap_load(struct db *db, uint64_t generation, int64_t mtime)
+{
+	const struct snaphdr *h;
+	const struct snapnode *nodes;
+	const struct snappkg *sp;
+	const uint32_t *ents;
+	const char *strs, *file, *version;
+	struct pathnode **map;
+	struct pkg *pkg;
+	struct pkgentry *pe;
+	struct stat sb;
+	char path[PATH_MAX];
+	void *p;
+	size_t len;
+	uint32_t i, j;
+	int fd;
+
+	snap_path(db, path);
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &sb) < 0 || (size_t)sb.st_size < sizeof(*h)) {
+		close(fd);
+		return -1;
+	}
+	p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return -1;
+	h = p;
+	if (memcmp(h->magic, SNAPMAGIC, sizeof(h->magic)) != 0 ||
+	    h->generation != generation || h->mtime != mtime ||
+	    h->sharded != (uint32_t)db->sharded ||
+	    !snap_valid(h, sb.st_size)) {
+		munmap(p, sb.st_size);
+		return -1;
+	}
+	nodes = (const void *)(h + 1);
+	sp = (const void *)(nodes + h->nnodes);
+	ents = (const void *)(sp + h->npkgs);
+	strs = (const void *)(ents + h->nentries);
+
+	path_reserve(db, h->nnodes);
+	map = emalloc(h->nnodes * sizeof(*map));
+	map[0] = path_add(db, NULL, NULL, 0);
+	for (i = 1; i < h->nnodes; i++)
+		map[i] = path_add(db, map[nodes[i].parent],
+				  strs + nodes[i].name,
+				  strlen(strs + nodes[i].name));
+
+	for (i = 0; i < h->npkgs; i++, sp++) {
+		file = strs + sp->file;
+		len = parse_db_entry(file, &version);
+		pkg = arena_alloc(&db->arena, sizeof(*pkg));
+		pkg->name = arena_strndup(&db->arena, file, len);
+		pkg->version = version ? arena_strdup(&db->arena, version) : NULL;
+		pkg->path = arena_strdup(&db->arena, db_entrypath(db, file, path));
+		pkg->arena = 1;
+		TAILQ_INIT(&pkg->pe_head);
+		TAILQ_INIT(&pkg->dep_head);
+		for (j = sp->entry; j < sp->entry + sp->nentries; j++) {
+			pe = arena_alloc(&db->arena, sizeof(*pe));
+			pe->node = map[ents[j] & ~SNAPDIR];
+			pe->dir = (ents[j] & SNAPDIR) != 0;
+			TAILQ_INSERT_TAIL(&pkg->pe_head, pe, entry);
+		}
+		TAILQ_INSERT_TAIL(&db->pkg_head, pkg, entry);
+		db_own(db, pkg);
+	}
+
+	free(map);
+	munmap(p, sb.st_size);
+	return 0;
+}
+
+struct nodelist {
+	struct nodeidx *v;
+	size_t n, sz;
+};
+
+static int
+collect_cb(struct pathnode *n, void *data)
+{
+	struct nodelist *l = data;
+
+	if (l->n == l->sz) {
+		l->sz = l->sz ? l->sz * 2 : 4096;
+		l->v = erealloc(l->v, l->sz * sizeof(*l->v));
+	}
+	l->v[l->n].node = n;
+	l->v[l->n].idx = l->n;
+	l->n++;
+	return 0;
+}
+
+static int
+cmpnodeidx(const void *a, const void *b)
+{
+	uintptr_t x = (uintptr_t)((const struct nodeidx *)a)->node;
+	uintptr_t y = (uintptr_t)((const struct nodeidx *)b)->node;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t
+nodeidx(struct nodelist *l, struct pathnode *n)
+{
+	struct nodeidx key, *r;
+
+	key.node = n;
+	r = bsearch(&key, l->v, l->n, sizeof(*l->v), cmpnodeidx);
+	return r->idx;
+}
+
+static uint32_t
+addstr(char **strs, size_t *strsz, size_t *cap, const char *s)
+{
+	size_t len = strlen(s) + 1, off = *strsz;
+
+	while (*strsz + len > *cap) {
+		*cap = *cap ? *cap * 2 : 65536;
+		*strs = erealloc(*strs, *cap);
+	}
+	memcpy(*strs + off, s, len);
+	*strsz += len;
+	return off;
+}
+
+/* Write a snapshot of the loaded db, taken at the given generation and
+ * mtime of DBPATH.  It is only a cache, so failing to write it, e.g.
+ * when not running as root, is not an error */
+void
+snap_save(struct db *db, uint64_t generation, int64_t mtime)
+{
+	struct snaphdr h;
+	struct snapnode *nodes;
+	struct snappkg *pkgs;
+	struct nodelist l = { 0 };
+	struct pkg *pkg;
+	struct pkgentry *pe;
+	char path[PATH_MAX], tmp[PATH_MAX], *strs = NULL, *file;
+	uint32_t *ents = NULL;
+	size_t strsz = 0, strcap = 0, nents = 0, entsz = 0, npkgs = 0, i;
+	FILE *fp;
+
+	path_subtree(path_add(db, NULL, NULL, 0), collect_cb, &l);
+	nodes = emalloc(l.n * sizeof(*nodes));
+	for (i = 0; i < l.n; i++)
+		nodes[i].name = addstr(&strs, &strsz, &strcap,
+				       i > 0 ? l.v[i].node->name : "");
+	qsort(l.v, l.n, sizeof(*l.v), cmpnodeidx);
+	for (i = 0; i < l.n; i++)
+		nodes[l.v[i].idx].parent = l.v[i].node->parent ?
+			nodeidx(&l, l.v[i].node->parent) : 0;
+
+	TAILQ_FOREACH(pkg, &db->pkg_head, entry)
+		npkgs++;
+	pkgs = emalloc(MAX(npkgs, 1) * sizeof(*pkgs));
+	npkgs = 0;
+	TAILQ_FOREACH(pkg, &db->pkg_head, entry) {
+		file = strrchr(pkg->path, '/');
+		pkgs[npkgs].file = addstr(&strs, &strsz, &strcap,
+					  file ? file + 1 : pkg->path);
+		pkgs[npkgs].entry = nents;
+		TAILQ_FOREACH(pe, &pkg->pe_head, entry) {
+			if (nents == entsz) {
+				entsz = entsz ? entsz * 2 : 65536;
+				ents = erealloc(ents, entsz * sizeof(*ents));
+			}
+			ents[nents++] = nodeidx(&l, pe->node) |
+					(pe->dir ? SNAPDIR : 0);
+		}
+		pkgs[npkgs].nentries = nents - pkgs[npkgs].entry;
+		npkgs++;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SNAPMAGIC, sizeof(h.magic));
+	h.generation = generation;
+	h.mtime = mtime;
+	h.sharded = db->sharded;
+	h.nnodes = l.n;
+	h.npkgs = npkgs;
+	h.nentries = nents;
+	h.strsz = strsz;
+
+	snap_path(db, path);
+	estrlcpy(tmp, path, sizeof(tmp));
+	estrlcat(tmp, ".tmp", sizeof(tmp));
+	if ((fp = fopen(tmp, "w"))) {
+		fwrite(&h, sizeof(h), 1, fp);
+		fwrite(nodes, sizeof(*nodes), l.n, fp);
+		fwrite(pkgs, sizeof(*pkgs), npkgs, fp);
+		if (nents > 0)
+			fwrite(ents, sizeof(*ents), nents, fp);
+		fwrite(strs, 1, strsz, fp);
+		if (fclose(fp) == EOF || rename(tmp, path) < 0)
+			unlink(tmp);
+	}
+
+	free(l.v);
+	free(nodes);
+	free(pkgs);
+	free(ents);
+	free(strs);
+}
@@ -0,0 +1,168 @@
+/* See LICENSE file for copyright and license details. */
+#include "pkg.h"
+
+/*
+ * Token buckets limiting how fast files are written and removed.  A
+ * bucket holds up to a second worth of tokens and callers sleep until
+ * there are enough for them, so a large request waits in proportion.
+ * The state of a bucket lives in shared memory, so all threads and the
+ * processes forked for parallel jobs draw from the same bucket and the
+ * limit holds for the whole invocation.  A bucket with a rate of 0 does
+ * not limit or count anything.
+ */
+
+struct bucket bytelimit = { "bytes", 0, NULL };
+struct bucket filelimit = { "files", 0, NULL };
+
+static volatile sig_atomic_t reportnow;
+
+/* Parse a rate per second, with an optional k, m or g suffix */
+double
+parse_rate(const char *s)
+{
+	char *end;
+	double r;
+
+	errno = 0;
+	r = strtod(s, &end);
+	switch (*end) {
+	case 'g': case 'G':
+		r *= 1024;
+		/* fallthrough */
+	case 'm': case 'M':
+		r *= 1024;
+		/* fallthrough */
+	case 'k': case 'K':
+		r *= 1024;
+		end++;
+		break;
+	}
+	if (errno != 0 || end == s || *end != '\0' || r <= 0)
+		eprintf("%s: invalid rate\n", s);
+	return r;
+}
+
+static void
+report_handler(int sig)
+{
+	(void) sig;
+
+	reportnow = 1;
+}
+
+/* Have SIGUSR1 interrupt blocking calls while `on' is set, so a process
+ * that only waits for others gets to report */
+void
+bucket_interrupt(int on)
+{
+	struct sigaction sa;
+
+	/* nothing to report */
+	if (!bytelimit.s && !filelimit.s)
+		return;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = report_handler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = on ? 0 : SA_RESTART;
+	sigaction(SIGUSR1, &sa, NULL);
+}
+
+/* Limit `b' to `rate' tokens per second.  The counters are printed on
+ * SIGUSR1 and by bucket_report() */
+void
+bucket_set(struct bucket *b, double rate)
+{
+	pthread_mutexattr_t attr;
+	void *p;
+
+	if (!b->s) {
+		p = mmap(NULL, sizeof(*b->s), PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			eprintf("mmap:");
+		b->s = p;
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+		pthread_mutex_init(&b->s->lock, &attr);
+		pthread_mutexattr_destroy(&attr);
+	}
+	b->rate = rate;
+	b->s->tokens = rate;
+	clock_gettime(CLOCK_MONOTONIC, &b->s->last);
+	bucket_interrupt(0);
+}
+
+/* A job killed while sleeping with the lock held must not stall the
+ * others, the state it leaves behind is good enough */
+static void
+bucket_lock(struct bucketstate *s)
+{
+	if (pthread_mutex_lock(&s->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&s->lock);
+}
+
+static double
+elapsed(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/* Take `n' tokens from `b', waiting until they are available */
+void
+bucket_take(struct bucket *b, double n)
+{
+	struct bucketstate *s = b->s;
+	struct timespec now, ts;
+	double wait;
+
+	bucket_poll();
+	if (b->rate == 0)
+		return;
+	bucket_lock(s);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	s->tokens = MIN(b->rate, s->tokens + elapsed(&s->last, &now) * b->rate);
+	s->last = now;
+	s->tokens -= n;
+	s->taken += n;
+	if (s->tokens < 0) {
+		/* sleep with the lock held, the others would only wait for
+		 * the same tokens */
+		wait = -s->tokens / b->rate;
+		ts.tv_sec = wait;
+		ts.tv_nsec = (wait - ts.tv_sec) * 1e9;
+		while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+			;
+		s->waited += wait;
+		clock_gettime(CLOCK_MONOTONIC, &s->last);
+		s->tokens = 0;
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Print the counters of the buckets that are limited */
+void
+bucket_report(void)
+{
+	struct bucket *b[] = { &bytelimit, &filelimit };
+	size_t i;
+
+	for (i = 0; i < LEN(b); i++) {
+		if (b[i]->rate == 0)
+			continue;
+		bucket_lock(b[i]->s);
+		fprintf(stderr, "%s: %.0f at %.0f/s, waited %.2fs\n", b[i]->name,
+			b[i]->s->taken, b[i]->rate, b[i]->s->waited);
+		pthread_mutex_unlock(&b[i]->s->lock);
+	}
+}
+
+/* Print the counters if SIGUSR1 came in since the last call */
+void
+bucket_poll(void)
+{
+	if (reportnow) {
+		reportnow = 0;
+		bucket_report();
+	}
+}
@@ -0,0 +1,215 @@
+/* See LICENSE file for copyright and license details. */
+#include "pkg.h"
+
+/*
+ * With removepkg -d, removed files are renamed into a batch directory
+ * below TRASHPATH instead of being unlinked, and a reaper deletes them
+ * in the background.  Batches are created with a leading dot and only
+ * lose it once complete, so the reaper never races a removal.  A
+ * rename does not cross filesystems, callers remove such files in place.
+ */
+
+#define TRASHLOCK  ".lock"
+#define REAPBATCH  64			/* removals between pauses */
+#define REAPPAUSE  10000000L		/* nanoseconds */
+#define REAPSTALE  86400		/* age of an abandoned batch in seconds */
+
+static unsigned long nreaped;
+static int reapfailed;
+
+static char *
+trash_path(const char *root, const char *name, char *buf)
+{
+	estrlcpy(buf, root, PATH_MAX);
+	/* avoid a double slash for a db root of "/" */
+	if (strcmp(root, "/") == 0)
+		buf[0] = '\0';
+	estrlcat(buf, TRASHPATH, PATH_MAX);
+	if (name) {
+		estrlcat(buf, "/", PATH_MAX);
+		estrlcat(buf, name, PATH_MAX);
+	}
+	return buf;
+}
+
+/* Start a new batch in the trash of the db root */
+int
+trash_open(struct db *db, struct trash *t)
+{
+	char path[PATH_MAX];
+
+	trash_path(db->root, NULL, path);
+	if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+		weprintf("mkdir %s:", path);
+		return -1;
+	}
+	trash_path(db->root, ".XXXXXX", t->path);
+	if (!mkdtemp(t->path)) {
+		weprintf("mkdtemp %s:", t->path);
+		return -1;
+	}
+	t->n = 0;
+	return 0;
+}
+
+/* Rename `path' into the batch.  Return -1 if it has to be removed in
+ * place, only warning if that is not because of a different filesystem */
+int
+trash_move(struct trash *t, const char *path)
+{
+	char dst[PATH_MAX], n[32];
+
+	snprintf(n, sizeof(n), "/%lu", t->n);
+	estrlcpy(dst, t->path, sizeof(dst));
+	estrlcat(dst, n, sizeof(dst));
+	if (rename(path, dst) < 0) {
+		if (errno != EXDEV)
+			weprintf("rename %s %s:", path, dst);
+		return -1;
+	}
+	t->n++;
+	return 0;
+}
+
+/* Hand the batch over to the reaper */
+int
+trash_close(struct trash *t)
+{
+	char path[PATH_MAX], *base;
+
+	if (t->n == 0) {
+		rmdir(t->path);
+		return 0;
+	}
+	estrlcpy(path, t->path, sizeof(path));
+	base = strrchr(path, '/') + 1;
+	memmove(base, base + 1, strlen(base));
+	if (rename(t->path, path) < 0) {
+		weprintf("rename %s %s:", t->path, path);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+reap_cb(const char *f, const struct stat *sb, int typeflag,
+	struct FTW *ftwbuf)
+{
+	struct timespec ts = { 0, REAPPAUSE };
+
+	(void) sb;
+	(void) ftwbuf;
+
+	if (vflag == 1)
+		printf("removing %s\n", f);
+	bucket_take(&filelimit, 1);
+	if ((typeflag == FTW_DP ? rmdir(f) : unlink(f)) < 0) {
+		weprintf("remove %s:", f);
+		reapfailed = 1;
+		return 0;
+	}
+	if (++nreaped % REAPBATCH == 0)
+		nanosleep(&ts, NULL);
+	return 0;
+}
+
+/* Delete the complete batches in the trash of `root', pausing every
+ * REAPBATCH removals so the disk stays available to everybody else.
+ * Batches handed over meanwhile are picked up as well, the trash is
+ * scanned until a pass removes nothing.  Return -1 if something was
+ * left behind */
+int
+trash_reap(const char *root)
+{
+	DIR *dp;
+	struct dirent *de;
+	struct stat sb;
+	char path[PATH_MAX];
+	unsigned long n;
+	int fd;
+
+	trash_path(root, TRASHLOCK, path);
+	if ((fd = open(path, O_RDWR | O_CREAT, 0600)) < 0) {
+		if (errno == ENOENT)
+			return 0;
+		weprintf("open %s:", path);
+		return -1;
+	}
+	/* reapers queue up behind each other, the one running might have
+	 * looked at the trash before the latest batch was handed over */
+	if (flock(fd, LOCK_EX) < 0) {
+		weprintf("flock %s:", path);
+		close(fd);
+		return -1;
+	}
+	do {
+		n = nreaped;
+		reapfailed = 0;
+		if (!(dp = opendir(trash_path(root, NULL, path)))) {
+			weprintf("opendir %s:", path);
+			reapfailed = 1;
+			break;
+		}
+		while ((de = readdir(dp))) {
+			if (strcmp(de->d_name, ".") == 0 ||
+			    strcmp(de->d_name, "..") == 0 ||
+			    strcmp(de->d_name, TRASHLOCK) == 0)
+				continue;
+			trash_path(root, de->d_name, path);
+			/* a batch still being filled, unless it was left
+			 * behind by an interrupted removal */
+			if (de->d_name[0] == '.' &&
+			    (lstat(path, &sb) < 0 ||
+			     time(NULL) - sb.st_mtime < REAPSTALE))
+				continue;
+			nftw(path, reap_cb, 16, FTW_DEPTH | FTW_PHYS);
+		}
+		closedir(dp);
+	} while (nreaped != n);
+	close(fd);
+	return reapfailed ? -1 : 0;
+}
+
+/* Run trash_reap() in a detached process at the lowest priority, which
+ * also lowers its best effort I/O priority */
+void
+trash_spawn(const char *root)
+{
+	struct sigaction sa;
+	pid_t pid;
+	int fd;
+
+	fflush(NULL);
+	if ((pid = fork()) < 0) {
+		weprintf("fork:");
+		return;
+	}
+	if (pid > 0) {
+		waitpid(pid, NULL, 0);
+		return;
+	}
+	setsid();
+	if (fork() != 0)
+		_exit(EXIT_SUCCESS);
+	/* db_new() ignores these to protect the db, the reaper has
+	 * nothing to protect and should be easy to stop */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_DFL;
+	sigaction(SIGHUP, &sa, 0);
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGQUIT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+	if ((fd = open("/dev/null", O_RDWR)) >= 0) {
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		if (fd > STDERR_FILENO)
+			close(fd);
+	}
+	if (chdir("/") < 0)
+		_exit(EXIT_FAILURE);
+	setpriority(PRIO_PROCESS, 0, 19);
+	vflag = 0;
+	trash_reap(root);
+	_exit(EXIT_SUCCESS);
+}